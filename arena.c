@@ -0,0 +1,84 @@
+#include "laxasm.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Arenas.  Things that are allocated a piece at a time and all freed
+ * together are carved from large blocks rather than each having its
+ * own malloc.  There are two arenas: one for things that last for the
+ * whole run, symbols and macro bodies, and one for things that last
+ * only for a pass, file names and forward references, which is
+ * emptied as each pass starts.
+ */
+
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN (sizeof(void *) * 2)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	max_align_t data[];
+};
+
+struct arena run_arena = { "run" };
+struct arena pass_arena = { "pass" };
+
+static void arena_newblock(struct arena *a, size_t size)
+{
+	if (size < ARENA_BLOCK)
+		size = ARENA_BLOCK;
+	struct arena_block *blk = malloc(sizeof(struct arena_block) + size);
+	if (!blk) {
+		fprintf(stderr, "laxasm: out of memory allocating %lu bytes for the %s arena\n", (unsigned long)size, a->name);
+		exit(1);
+	}
+	blk->next = a->blocks;
+	blk->size = size;
+	a->blocks = blk;
+	a->next = (char *)blk->data;
+	a->left = size;
+	if (++a->nblocks > a->max_blocks)
+		a->max_blocks = a->nblocks;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (size > a->left)
+		arena_newblock(a, size);
+	void *ptr = a->next;
+	a->next += size;
+	a->left -= size;
+	a->allocs++;
+	a->bytes += size;
+	return ptr;
+}
+
+char *arena_strndup(struct arena *a, const char *src, size_t len)
+{
+	char *str = arena_alloc(a, len + 1);
+	memcpy(str, src, len);
+	str[len] = 0;
+	return str;
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_block *blk = a->blocks;
+	while (blk) {
+		struct arena_block *next = blk->next;
+		free(blk);
+		blk = next;
+	}
+	a->blocks = NULL;
+	a->next = NULL;
+	a->left = 0;
+	a->nblocks = 0;
+}
+
+void arena_stats(const struct arena *a)
+{
+	fprintf(stderr, "laxasm: %s arena: %lu allocations, %lu bytes, at most %u blocks\n",
+	        a->name, a->allocs, (unsigned long)a->bytes, a->max_blocks);
+}
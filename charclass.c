@@ -0,0 +1,20 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "charclass.h"
+
+const uint8_t asm_ctype[256] = {
+	['\t']        = CC_SPACE,
+	[' ']         = CC_SPACE,
+	['\n']        = CC_NL,
+	[';']         = CC_COMMENT,
+	['\\']        = CC_COMMENT,
+	['*']         = CC_COMMENT,
+	['$']         = CC_SYMCH,
+	['.']         = CC_SYMCH,
+	['_']         = CC_SYMCH,
+	['0' ... '9'] = CC_DIGIT|CC_HEX|CC_SYMCH,
+	['A' ... 'F'] = CC_ALPHA|CC_HEX|CC_SYMCH,
+	['G' ... 'Z'] = CC_ALPHA|CC_SYMCH,
+	['a' ... 'f'] = CC_ALPHA|CC_HEX|CC_SYMCH|CC_LOWER,
+	['g' ... 'z'] = CC_ALPHA|CC_SYMCH|CC_LOWER
+};
@@ -1,19 +1,75 @@
 #ifndef ASM_CHARCLASS
 #define ASM_CHARCLASS
 
+/*
+ * Character classes.  Each byte value has a set of class bits in
+ * asm_ctype so any test of what kind of character is to hand is a
+ * single table lookup and mask.
+ */
+
+#define CC_SPACE   0x01
+#define CC_COMMENT 0x02
+#define CC_NL      0x04
+#define CC_ALPHA   0x08
+#define CC_DIGIT   0x10
+#define CC_HEX     0x20
+#define CC_SYMCH   0x40 /* may continue a symbol */
+#define CC_LOWER   0x80
+
+extern const uint8_t asm_ctype[256];
+
 static inline bool asm_isspace(int ch)
 {
-	return ch == ' ' || ch == '\t';
+	return asm_ctype[(uint8_t)ch] & CC_SPACE;
 }
 
 static inline bool asm_iscomment(int ch)
 {
-	return ch == ';' || ch == '\\' || ch == '*';
+	return asm_ctype[(uint8_t)ch] & CC_COMMENT;
 }
 
 static inline bool asm_isendchar(int ch)
 {
-	return ch == '\n' || asm_iscomment(ch);
+	return asm_ctype[(uint8_t)ch] & (CC_NL|CC_COMMENT);
+}
+
+/* Space or the end of the useful part of the line, i.e. the end of a field. */
+
+static inline bool asm_isdelim(int ch)
+{
+	return asm_ctype[(uint8_t)ch] & (CC_SPACE|CC_NL|CC_COMMENT);
+}
+
+static inline bool asm_isalpha(int ch)
+{
+	return asm_ctype[(uint8_t)ch] & CC_ALPHA;
+}
+
+static inline bool asm_isdigit(int ch)
+{
+	return asm_ctype[(uint8_t)ch] & CC_DIGIT;
+}
+
+static inline bool asm_ishex(int ch)
+{
+	return asm_ctype[(uint8_t)ch] & CC_HEX;
+}
+
+static inline bool asm_issymch(int ch)
+{
+	return asm_ctype[(uint8_t)ch] & CC_SYMCH;
+}
+
+/* The value of a character for which asm_ishex is true. */
+
+static inline unsigned asm_hexval(int ch)
+{
+	return (ch & 0x0f) + ((ch >> 6) & 1) * 9;
+}
+
+static inline int asm_toupper(int ch)
+{
+	return ch & ~((asm_ctype[(uint8_t)ch] & CC_LOWER) >> 2);
 }
 
 #endif
@@ -1,212 +1,732 @@
 #include "laxasm.h"
 #include <stdlib.h>
+#include <string.h>
 
-static int expr_term(struct inctx *inp, bool no_undef)
+#include "charclass.h"
+
+/*
+ * Expressions are compiled to a simple stack-machine code which is then
+ * run.  Where a line has a lineir, the compiled form is kept there,
+ * keyed by where in the line the expression starts.  Constant
+ * sub-expressions are folded as they are compiled.  Symbols are looked
+ * up as they are compiled and the symbol kept; one not yet defined, or
+ * a local symbol found in a different BLOCK, is looked up again when
+ * the code is run.
+ *
+ * Errors are compiled as instructions so they are reported when the
+ * code is run, in the same order and at the same column as they would
+ * be by evaluating the text directly.
+ */
+
+enum exop {
+	EX_CONST,
+	EX_ORG,
+	EX_PASS,
+	EX_SYM,
+	EX_BADTERM,
+	EX_BRACKET,
+	EX_BIGNUM,
+	EX_NEG,
+	EX_INV,
+	EX_LOW,
+	EX_HIGH,
+	EX_AND,
+	EX_OR,
+	EX_EQ,
+	EX_NE,
+	EX_GT,
+	EX_GE,
+	EX_LT,
+	EX_LE,
+	EX_MUL,
+	EX_DIV,
+	EX_SHL,
+	EX_SHR,
+	EX_ADD,
+	EX_SUB
+};
+
+struct exinsn {
+	uint8_t op;
+	unsigned posn;          /* in the line, for errors and symbols */
+	int value;              /* a constant, or the scope a symbol was found in */
+	struct symbol *sym;
+};
+
+struct exprcode {
+	struct exprcode *next;  /* next expression on the same line */
+	char *text;             /* the line */
+	unsigned posn;          /* where the expression starts */
+	unsigned end;           /* and where it finishes */
+	unsigned ninsn;
+	unsigned depth;         /* of stack needed */
+	struct exinsn code[];
+};
+
+#define EXPR_SMALL 32
+
+struct excomp {
+	struct inctx *inp;
+	struct exinsn *code;
+	unsigned ninsn;
+	unsigned alloc;
+	unsigned depth;
+	unsigned max_depth;
+	struct exinsn small[EXPR_SMALL];
+};
+
+bool expr_forward;
+
+__attribute__((noreturn))
+static void expr_nomem(void)
+{
+	fprintf(stderr, "laxasm: out of memory compiling an expression\n");
+	exit(1);
+}
+
+static struct exinsn *expr_emit(struct excomp *cs, enum exop op, int push)
 {
-    int value, ch = non_space(inp);
-    if (ch == '*') {
-		value = org;
+	if (cs->ninsn == cs->alloc) {
+		struct exinsn *code;
+		cs->alloc <<= 1;
+		if (cs->code == cs->small) {
+			if ((code = malloc(cs->alloc * sizeof(struct exinsn))))
+				memcpy(code, cs->small, sizeof(cs->small));
+		}
+		else
+			code = realloc(cs->code, cs->alloc * sizeof(struct exinsn));
+		if (!code)
+			expr_nomem();
+		cs->code = code;
+	}
+	struct exinsn *ip = cs->code + cs->ninsn++;
+	ip->op = op;
+	ip->posn = cs->inp->lineptr - cs->inp->line.str;
+	ip->value = 0;
+	ip->sym = NULL;
+	cs->depth += push;
+	if (cs->depth > cs->max_depth)
+		cs->max_depth = cs->depth;
+	return ip;
+}
+
+static void expr_const(struct excomp *cs, int value)
+{
+	expr_emit(cs, EX_CONST, 1)->value = value;
+}
+
+static int expr_unop(enum exop op, int value)
+{
+	switch(op) {
+		case EX_NEG:
+			return -value;
+		case EX_INV:
+			return value ^ 0xffff;
+		case EX_LOW:
+			return value & 0xff;
+		default:
+			return (value >> 8) & 0xff;
+	}
+}
+
+/* Apply a binary operator, returning false for division by zero. */
+
+static bool expr_binop(enum exop op, int *left, int right)
+{
+	int value = *left;
+	switch(op) {
+		case EX_AND:
+			value &= right;
+			break;
+		case EX_OR:
+			value |= right;
+			break;
+		case EX_EQ:
+			value = (value == right) ? -1 : 0;
+			break;
+		case EX_NE:
+			value = (value != right) ? -1 : 0;
+			break;
+		case EX_GT:
+			value = (value > right) ? -1 : 0;
+			break;
+		case EX_GE:
+			value = (value >= right) ? -1 : 0;
+			break;
+		case EX_LT:
+			value = (value < right) ? -1 : 0;
+			break;
+		case EX_LE:
+			value = (value <= right) ? -1 : 0;
+			break;
+		case EX_MUL:
+			value *= right;
+			break;
+		case EX_DIV:
+			if (right == 0)
+				return false;
+			value /= right;
+			break;
+		case EX_SHL:
+			value <<= right;
+			break;
+		case EX_SHR:
+			value >>= right;
+			break;
+		case EX_ADD:
+			value += right;
+			break;
+		default:
+			value -= right;
+	}
+	*left = value;
+	return true;
+}
+
+static void expr_unary_op(struct excomp *cs, enum exop op)
+{
+	struct exinsn *last = cs->code + cs->ninsn - 1;
+	if (last->op == EX_CONST)
+		last->value = expr_unop(op, last->value);
+	else
+		expr_emit(cs, op, 0);
+}
+
+static void expr_binary_op(struct excomp *cs, enum exop op)
+{
+	struct exinsn *last = cs->code + cs->ninsn - 1;
+	if (last[-1].op == EX_CONST && last->op == EX_CONST && expr_binop(op, &last[-1].value, last->value)) {
+		--cs->ninsn;
+		--cs->depth;
+	}
+	else
+		expr_emit(cs, op, -1);
+}
+
+/*
+ * Numbers.  As only 16 bits are wanted, these do without strtoul's
+ * locale, sign and white space handling and a number that does not fit
+ * is reported rather than being allowed to wrap.  Hex numbers of up to
+ * eight digits are converted a word at a time, one digit per byte.
+ */
+
+static uint32_t expr_hex8(const char *src, size_t ndig)
+{
+	uint64_t x;
+	memcpy(&x, src, 8);
+	x = (x & 0x0f0f0f0f0f0f0f0full) + ((x >> 6) & 0x0101010101010101ull) * 9;
+	x <<= (8 - ndig) * 8; /* drop the bytes after the digits */
+	x = ((x << 4) | (x >> 8)) & 0x00ff00ff00ff00ffull;
+	x = ((x << 8) | (x >> 16)) & 0x0000ffff0000ffffull;
+	x = ((x << 16) | (x >> 32)) & 0x00000000ffffffffull;
+	return x;
+}
+
+static uint32_t expr_hex(struct inctx *inp, bool *big)
+{
+	const char *src = inp->lineptr;
+	while (*src == '0')
+		++src;
+	const char *ptr = src;
+	while (asm_ishex(*ptr))
+		++ptr;
+	inp->lineptr = (char *)ptr;
+	size_t ndig = ptr - src;
+	uint32_t value = 0;
+	if (ndig > 8) {
+		src = ptr - 8;
+		ndig = 8;
+		*big = true;
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (ndig && src + 8 <= inp->line.str + inp->line.used)
+		value = expr_hex8(src, ndig);
+	else
+#endif
+		while (src < ptr)
+			value = (value << 4) | asm_hexval(*src++);
+	if (value > 0xffff)
+		*big = true;
+	return value;
+}
+
+static uint32_t expr_decimal(struct inctx *inp, bool *big)
+{
+	const char *ptr = inp->lineptr;
+	uint32_t value = 0;
+	while (asm_isdigit(*ptr)) {
+		value = value * 10 + (*ptr++ - '0');
+		if (value > 0xffff) {
+			*big = true;
+			value &= 0xffff;
+		}
+	}
+	inp->lineptr = (char *)ptr;
+	return value;
+}
+
+static uint32_t expr_binary(struct inctx *inp, bool *big)
+{
+	const char *ptr = inp->lineptr;
+	uint32_t value = 0;
+	while (*ptr == '0' || *ptr == '1') {
+		value = (value << 1) | (*ptr++ - '0');
+		if (value > 0xffff) {
+			*big = true;
+			value &= 0xffff;
+		}
+	}
+	inp->lineptr = (char *)ptr;
+	return value;
+}
+
+/*
+ * Parse a literal number on its own, for the fast path for lists of
+ * data.  Returns false, leaving the line pointer alone, if what is there
+ * is not a number that fits in 16 bits.
+ */
+
+bool expr_literal(struct inctx *inp, unsigned *value)
+{
+	char *start = inp->lineptr;
+	uint32_t (*conv)(struct inctx *inp, bool *big);
+	int ch = *start;
+	if (asm_isdigit(ch))
+		conv = expr_decimal;
+	else {
+		int ch2 = start[1];
+		if ((ch == '$' || ch == '&') && asm_ishex(ch2))
+			conv = expr_hex;
+		else if (ch == '%' && (ch2 == '0' || ch2 == '1'))
+			conv = expr_binary;
+		else
+			return false;
+		++inp->lineptr;
+	}
+	bool big = false;
+	*value = conv(inp, &big);
+	if (big) {
+		inp->lineptr = start;
+		return false;
+	}
+	return true;
+}
+
+static void expr_number(struct excomp *cs, uint32_t (*conv)(struct inctx *inp, bool *big), int skip)
+{
+	struct inctx *inp = cs->inp;
+	unsigned start = inp->lineptr - inp->line.str;
+	bool big = false;
+	inp->lineptr += skip;
+	uint32_t value = conv(inp, &big);
+	if (big) {
+		struct exinsn *ip = expr_emit(cs, EX_BIGNUM, 1);
+		ip->posn = start;
+		ip->value = value & 0xffff;
+	}
+	else
+		expr_const(cs, value);
+}
+
+static void expr_term(struct excomp *cs)
+{
+	struct inctx *inp = cs->inp;
+	int value, ch = non_space(inp);
+	if (ch == '*') {
+		expr_emit(cs, EX_ORG, 1);
 		++inp->lineptr;
 	}
 	else if (ch == '\'' || ch == '"') {
-        bool ctrl = false;
-        bool topset = false;
-        ch = *++inp->lineptr;
-        if (ch == '|') {
-            ch = *++inp->lineptr;
-            if (ch != '|') {
-                ctrl = true;
-                ch = *++inp->lineptr;
-            }
-        }
-        if (ch == '^') {
-            ch = *++inp->lineptr;
-            if (ch != '^') {
-                topset = true;
-                ch = *++inp->lineptr;
-            }
-        }
-        value = ch & 0x7f;
-        if (ctrl)
-            value &= 0x1f;
-        else if (topset)
-            value |= 0x80;
-        ch = *++inp->lineptr;
-        if (ch == '\'' || ch == '"')
-            ++inp->lineptr;
-    }
-    else if (ch == '%')
-        value = strtoul(inp->lineptr + 1, &inp->lineptr, 2);
-    else if (ch == '$' || ch == '&')
-        value = strtoul(inp->lineptr + 1, &inp->lineptr, 16);
-    else if (ch >= '0' && ch <= '9')
-        value = strtoul(inp->lineptr, &inp->lineptr, 10);
-    else if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || ch == ':') {
-		struct symbol *sym = symbol_lookup(inp, no_undef);
-		value = sym ? sym->value : org;
+		bool ctrl = false;
+		bool topset = false;
+		ch = *++inp->lineptr;
+		if (ch == '|') {
+			ch = *++inp->lineptr;
+			if (ch != '|') {
+				ctrl = true;
+				ch = *++inp->lineptr;
+			}
+		}
+		if (ch == '^') {
+			ch = *++inp->lineptr;
+			if (ch != '^') {
+				topset = true;
+				ch = *++inp->lineptr;
+			}
+		}
+		value = ch & 0x7f;
+		if (ctrl)
+			value &= 0x1f;
+		else if (topset)
+			value |= 0x80;
+		ch = *++inp->lineptr;
+		if (ch == '\'' || ch == '"')
+			++inp->lineptr;
+		expr_const(cs, value);
 	}
-	else if (ch == '#')
-		value = passno ? -1 : 0;
-	else {
-		asm_error(inp, "invalid expression");
-		value = org;
+	else if (ch == '%')
+		expr_number(cs, expr_binary, 1);
+	else if (ch == '$' || ch == '&')
+		expr_number(cs, expr_hex, 1);
+	else if (asm_isdigit(ch))
+		expr_number(cs, expr_decimal, 0);
+	else if (asm_isalpha(ch) || ch == ':') {
+		struct exinsn *ip = expr_emit(cs, EX_SYM, 1);
+		ip->value = scope_no;
+		ip->sym = symbol_lookup(inp, false);
 	}
+	else if (ch == '#')
+		expr_emit(cs, EX_PASS, 1);
+	else
+		expr_emit(cs, EX_BADTERM, 1);
 	ch = *inp->lineptr;
-	while (ch == ' ' || ch == '\t' || ch == 0xdd)
+	while (asm_isspace(ch))
 		ch = *++inp->lineptr;
-	return value;
 }
 
-static int expr_bracket(struct inctx *inp, bool no_undef)
+static void expr_full(struct excomp *cs);
+
+static void expr_bracket(struct excomp *cs)
 {
+	struct inctx *inp = cs->inp;
 	int ch = non_space(inp);
 	if (ch == '(')
 		ch= ')';
 	else if (ch == '[')
 		ch = ']';
+	else {
+		expr_term(cs);
+		return;
+	}
+	++inp->lineptr;
+	expr_full(cs);
+	if (*inp->lineptr == ch)
+		do ch = *++inp->lineptr; while (asm_isspace(ch));
 	else
-        return expr_term(inp, no_undef);
-    ++inp->lineptr;
-    int value = expression(inp, no_undef);
-    if (*inp->lineptr == ch)
-		do ch = *++inp->lineptr; while (ch == ' ' || ch == '\t' || ch == 0xdd);
-    else
-		asm_error(inp, "missing or mismatched bracket");
-    return value;
+		expr_emit(cs, EX_BRACKET, 0);
 }
 
-static int expr_unary(struct inctx *inp, bool no_undef)
+static void expr_unary(struct excomp *cs)
 {
-    int ch = non_space(inp);
-    if (ch == '+')
+	struct inctx *inp = cs->inp;
+	int ch = non_space(inp);
+	if (ch == '+')
 		ch = *++inp->lineptr;
-    if (ch == '-') {
-        ++inp->lineptr;
-        return -expr_bracket(inp, no_undef);
-    }
-    else if (ch == '~') {
-        ++inp->lineptr;
-        return expr_bracket(inp, no_undef) ^ 0xffff;
-    }
-    else
-        return expr_bracket(inp, no_undef);
-}
-
-static int expr_bitwise(struct inctx *inp, bool no_undef)
-{
-    int value = expr_unary(inp, no_undef);
-    for (;;) {
-        int ch = *inp->lineptr;
-        if (ch == '&') {
-            ++inp->lineptr;
-            value &= expr_unary(inp, no_undef);
-        }
-        else if (ch == '!') {
-            ++inp->lineptr;
-            value |= expr_unary(inp, no_undef);
-        }
-        else
-            return value;
-    }
-}
-
-static int expr_compare(struct inctx *inp, bool no_undef)
-{
-    int value = expr_bitwise(inp, no_undef);
-    for (;;) {
-        int ch = *inp->lineptr;
-        if (ch == '=') {
-            ++inp->lineptr;
-            value = (value == expr_bitwise(inp, no_undef)) ? -1 : 0;
-        }
-        else if (ch == '#') {
-            ++inp->lineptr;
-            value = (value != expr_bitwise(inp, no_undef)) ? -1 : 0;
-        }
-        else if (ch == '>') {
-            ch = *++inp->lineptr;
-            int right = expr_bitwise(inp, no_undef);
-            if (ch == '=') {
+	if (ch == '-') {
+		++inp->lineptr;
+		expr_bracket(cs);
+		expr_unary_op(cs, EX_NEG);
+	}
+	else if (ch == '~') {
+		++inp->lineptr;
+		expr_bracket(cs);
+		expr_unary_op(cs, EX_INV);
+	}
+	else
+		expr_bracket(cs);
+}
+
+static void expr_bitwise(struct excomp *cs)
+{
+	struct inctx *inp = cs->inp;
+	expr_unary(cs);
+	for (;;) {
+		int ch = *inp->lineptr;
+		if (ch == '&') {
+			++inp->lineptr;
+			expr_unary(cs);
+			expr_binary_op(cs, EX_AND);
+		}
+		else if (ch == '!') {
+			++inp->lineptr;
+			expr_unary(cs);
+			expr_binary_op(cs, EX_OR);
+		}
+		else
+			return;
+	}
+}
+
+static void expr_compare(struct excomp *cs)
+{
+	struct inctx *inp = cs->inp;
+	expr_bitwise(cs);
+	for (;;) {
+		int ch = *inp->lineptr;
+		if (ch == '=') {
+			++inp->lineptr;
+			expr_bitwise(cs);
+			expr_binary_op(cs, EX_EQ);
+		}
+		else if (ch == '#') {
+			++inp->lineptr;
+			expr_bitwise(cs);
+			expr_binary_op(cs, EX_NE);
+		}
+		else if (ch == '>') {
+			ch = *++inp->lineptr;
+			expr_bitwise(cs);
+			if (ch == '=') {
 				++inp->lineptr;
-				value = (value >= right) ? -1 : 0;
+				expr_binary_op(cs, EX_GE);
 			}
 			else
-				value = (value > right) ? -1 : 0;
-        }
-        else if (ch == '<') {
-            ch = *++inp->lineptr;
-            int right = expr_bitwise(inp, no_undef);
-            if (ch == '=') {
+				expr_binary_op(cs, EX_GT);
+		}
+		else if (ch == '<') {
+			ch = *++inp->lineptr;
+			expr_bitwise(cs);
+			if (ch == '=') {
 				++inp->lineptr;
-				value = (value <= right) ? -1 : 0;
+				expr_binary_op(cs, EX_LE);
 			}
 			else
-				value = (value < right) ? -1 : 0;
-        }
-        else
-            return value;
-    }
-}
-
-static int expr_muldiv(struct inctx *inp, bool no_undef)
-{
-    int value = expr_compare(inp, no_undef);
-    for (;;) {
-        int ch = *inp->lineptr;
-        if (ch == '*') {
-            ++inp->lineptr;
-            value *= expr_compare(inp, no_undef);
-        }
-        else if (ch == '/') {
-            ++inp->lineptr;
-            int right = expr_compare(inp, no_undef);
-            if (right == 0)
-				asm_error(inp, "Division by zero");
-			else
-				value /= right;
-        }
-        else if (ch == '<' && inp->lineptr[1] == '<') {
+				expr_binary_op(cs, EX_LT);
+		}
+		else
+			return;
+	}
+}
+
+static void expr_muldiv(struct excomp *cs)
+{
+	struct inctx *inp = cs->inp;
+	expr_compare(cs);
+	for (;;) {
+		int ch = *inp->lineptr;
+		if (ch == '*') {
+			++inp->lineptr;
+			expr_compare(cs);
+			expr_binary_op(cs, EX_MUL);
+		}
+		else if (ch == '/') {
+			++inp->lineptr;
+			expr_compare(cs);
+			expr_binary_op(cs, EX_DIV);
+		}
+		else if (ch == '<' && inp->lineptr[1] == '<') {
 			inp->lineptr += 2;
-			value <<= expr_compare(inp, no_undef);
+			expr_compare(cs);
+			expr_binary_op(cs, EX_SHL);
 		}
 		else if (ch == '>' && inp->lineptr[1] == '>') {
 			inp->lineptr += 2;
-			value >>= expr_compare(inp, no_undef);
+			expr_compare(cs);
+			expr_binary_op(cs, EX_SHR);
 		}
 		else
-            return value;
-    }
+			return;
+	}
 }
 
-static int expr_addsub(struct inctx *inp, bool no_undef)
+static void expr_addsub(struct excomp *cs)
 {
-    int value = expr_muldiv(inp, no_undef);
-    for (;;) {
-        int ch = *inp->lineptr;
-        if (ch == '+') {
-            ++inp->lineptr;
-            value += expr_muldiv(inp, no_undef);
-        }
-        else if (ch == '-') {
-            ++inp->lineptr;
-            value -= expr_muldiv(inp, no_undef);
-        }
-        else
-            return value;
-    }
+	struct inctx *inp = cs->inp;
+	expr_muldiv(cs);
+	for (;;) {
+		int ch = *inp->lineptr;
+		if (ch == '+') {
+			++inp->lineptr;
+			expr_muldiv(cs);
+			expr_binary_op(cs, EX_ADD);
+		}
+		else if (ch == '-') {
+			++inp->lineptr;
+			expr_muldiv(cs);
+			expr_binary_op(cs, EX_SUB);
+		}
+		else
+			return;
+	}
 }
 
+static void expr_full(struct excomp *cs)
+{
+	struct inctx *inp = cs->inp;
+	int ch = non_space(inp);
+	if (ch == '>') {
+		++inp->lineptr;
+		expr_addsub(cs);
+		expr_unary_op(cs, EX_LOW);
+	}
+	else if (ch == '<') {
+		++inp->lineptr;
+		expr_addsub(cs);
+		expr_unary_op(cs, EX_HIGH);
+	}
+	else
+		expr_addsub(cs);
+}
+
+static void expr_compile(struct excomp *cs, struct inctx *inp)
+{
+	cs->inp = inp;
+	cs->code = cs->small;
+	cs->ninsn = 0;
+	cs->alloc = EXPR_SMALL;
+	cs->depth = 0;
+	cs->max_depth = 0;
+	expr_full(cs);
+}
+
+static void expr_done(struct excomp *cs)
+{
+	if (cs->code != cs->small)
+		free(cs->code);
+}
+
+/* Report an error at a given position in the line. */
+
+static void expr_error(struct inctx *inp, unsigned posn, const char *msg)
+{
+	char *save = inp->lineptr;
+	inp->lineptr = inp->line.str + posn;
+	asm_error(inp, "%s", msg);
+	inp->lineptr = save;
+}
+
+static int expr_symbol(struct inctx *inp, struct exinsn *ip, bool no_undef)
+{
+	struct symbol *sym = ip->sym;
+	if (!sym || (sym->scope != SCOPE_GLOBAL && ip->value != scope_no)) {
+		char *save = inp->lineptr;
+		inp->lineptr = inp->line.str + ip->posn;
+		sym = symbol_lookup(inp, no_undef);
+		inp->lineptr = save;
+		if (!sym) {
+			expr_forward = true;
+			return org;
+		}
+		ip->sym = sym;
+		ip->value = scope_no;
+	}
+	sym->used = 1;
+	if (!symbol_ready(sym, no_undef)) {
+		expr_forward = true;
+		return org;
+	}
+	return sym->value;
+}
+
+static int expr_run(struct inctx *inp, struct exinsn *ip, unsigned ninsn, unsigned depth, bool no_undef)
+{
+	int small[EXPR_SMALL], *stack = small;
+	if (depth > EXPR_SMALL && !(stack = malloc(depth * sizeof(int))))
+		expr_nomem();
+	int *sp = stack;
+	for (struct exinsn *end = ip + ninsn; ip < end; ++ip) {
+		switch(ip->op) {
+			case EX_CONST:
+				*sp++ = ip->value;
+				break;
+			case EX_ORG:
+				*sp++ = org;
+				break;
+			case EX_PASS:
+				*sp++ = passno ? -1 : 0;
+				break;
+			case EX_SYM:
+				*sp++ = expr_symbol(inp, ip, no_undef);
+				break;
+			case EX_BADTERM:
+				expr_error(inp, ip->posn, "invalid expression");
+				*sp++ = org;
+				break;
+			case EX_BRACKET:
+				expr_error(inp, ip->posn, "missing or mismatched bracket");
+				break;
+			case EX_BIGNUM:
+				expr_error(inp, ip->posn, "number too large for 16 bits");
+				*sp++ = ip->value;
+				break;
+			case EX_NEG:
+			case EX_INV:
+			case EX_LOW:
+			case EX_HIGH:
+				sp[-1] = expr_unop(ip->op, sp[-1]);
+				break;
+			default:
+				--sp;
+				if (!expr_binop(ip->op, sp - 1, *sp))
+					expr_error(inp, ip->posn, "Division by zero");
+		}
+	}
+	int value = sp > stack ? sp[-1] : 0;
+	if (stack != small)
+		free(stack);
+	return value;
+}
+
+static struct exprcode *expr_save(struct excomp *cs, struct arena *a, unsigned posn, char *text)
+{
+	struct exprcode *ec = arena_alloc(a, sizeof(struct exprcode) + cs->ninsn * sizeof(struct exinsn));
+	ec->next = NULL;
+	ec->text = text;
+	ec->posn = posn;
+	ec->end = cs->inp->lineptr - cs->inp->line.str;
+	ec->ninsn = cs->ninsn;
+	ec->depth = cs->max_depth;
+	memcpy(ec->code, cs->code, cs->ninsn * sizeof(struct exinsn));
+	return ec;
+}
+
+static int expr_start(struct inctx *inp, bool no_undef, struct exprcode **kept)
+{
+	expr_forward = false;
+	unsigned posn = inp->lineptr - inp->line.str;
+	struct exprcode *ec = NULL;
+	if (inp->ir)
+		for (ec = inp->ir->exprs; ec && ec->posn != posn; ec = ec->next)
+			;
+	if (!ec) {
+		struct excomp cs;
+		expr_compile(&cs, inp);
+		if (inp->ir) {
+			ec = expr_save(&cs, &run_arena, posn, inp->line.str);
+			ec->next = inp->ir->exprs;
+			inp->ir->exprs = ec;
+		}
+		else if (kept)
+			ec = expr_save(&cs, &pass_arena, posn, arena_strndup(&pass_arena, inp->line.str, inp->line.used));
+		else {
+			int value = expr_run(inp, cs.code, cs.ninsn, cs.max_depth, no_undef);
+			expr_done(&cs);
+			return value;
+		}
+		expr_done(&cs);
+	}
+	if (kept)
+		*kept = ec;
+	inp->lineptr = inp->line.str + ec->end;
+	return expr_run(inp, ec->code, ec->ninsn, ec->depth, no_undef);
+}
+
+/*
+ * Evaluate an expression.  If no_undef is false, a reference to a
+ * symbol not yet defined is not an error and sets expr_forward.
+ */
+
 int expression(struct inctx *inp, bool no_undef)
 {
-    int ch = non_space(inp);
-    if (ch == '>') {
-        ++inp->lineptr;
-        return expr_addsub(inp, no_undef) & 0xff;
-    }
-    else if (ch == '<') {
-        ++inp->lineptr;
-        return (expr_addsub(inp, no_undef) >> 8) & 0xff;
-    }
-    else
-        return expr_addsub(inp, no_undef);
+	return expr_start(inp, no_undef, NULL);
+}
+
+/*
+ * Evaluate an expression that is to be evaluated again later, as for
+ * WHILE, returning its compiled form, which lasts for the pass.
+ */
+
+int expr_keep(struct inctx *inp, bool no_undef, struct exprcode **kept)
+{
+	return expr_start(inp, no_undef, kept);
+}
+
+/* Evaluate again an expression kept by expr_keep. */
+
+int expr_again(struct inctx *inp, struct exprcode *ec, bool no_undef)
+{
+	expr_forward = false;
+	inp->line.str = ec->text;
+	inp->lineptr = ec->text + ec->end;
+	return expr_run(inp, ec->code, ec->ninsn, ec->depth, no_undef);
 }
@@ -0,0 +1,116 @@
+#include "laxasm.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Forward references in single-pass mode.
+ *
+ * When assembling in a single pass, an operand that refers to a symbol
+ * not yet defined is planted as zero and a record is kept of where in
+ * the object file it went along with a copy of the source line and the
+ * context needed to evaluate the expression again.  At the end of the
+ * pass, once all symbols are defined, each expression is evaluated
+ * again and the object file patched.  The records are taken from the
+ * pass arena so need not be freed one by one.
+ */
+
+struct fixup {
+	struct fixup *next;
+	const char *name;
+	long posn;
+	unsigned lineno;
+	unsigned scope;
+	unsigned exprpos;
+	size_t length;
+	uint16_t org;
+	uint16_t count;
+	uint8_t kind;
+	char text[1];
+};
+
+bool one_pass = false;
+
+static struct fixup *fix_head, **fix_tail = &fix_head;
+
+void fixup_add(struct inctx *inp, const char *expr, size_t offset, size_t count, enum fixkind kind)
+{
+	const char *end = strchr(expr, '\n');
+	size_t size = end - inp->line.str + 1;
+	struct fixup *fix = arena_alloc(&pass_arena, sizeof(struct fixup) + size);
+	fix->next = NULL;
+	fix->name = inp->name;
+	fix->lineno = inp->lineno;
+	fix->scope = scope_no;
+	fix->org = org;
+	fix->count = count;
+	fix->kind = kind;
+	fix->exprpos = expr - inp->line.str;
+	fix->length = size;
+	fix->posn = (obj_fp && !in_dsect) ? ftell(obj_fp) + offset : -1;
+	memcpy(fix->text, inp->line.str, size);
+	*fix_tail = fix;
+	fix_tail = &fix->next;
+}
+
+static void fixup_one(struct fixup *fix)
+{
+	struct inctx fctx;
+	memset(&fctx, 0, sizeof(fctx));
+	fctx.name = fix->name;
+	fctx.lineno = fix->lineno;
+	fctx.line.str = fix->text;
+	fctx.line.used = fix->length;
+	fctx.lineptr = fix->text + fix->exprpos;
+	org = fix->org;
+	scope_no = fix->scope;
+	uint16_t value = expression(&fctx, true);
+	uint8_t bytes[2];
+	size_t width = 2;
+	switch(fix->kind) {
+		case FIX_BYTE:
+			bytes[0] = value;
+			width = 1;
+			break;
+		case FIX_WORD:
+			bytes[0] = value;
+			bytes[1] = value >> 8;
+			break;
+		case FIX_DBYTE:
+			bytes[0] = value >> 8;
+			bytes[1] = value;
+			break;
+		case FIX_REL:
+			{
+				int offs = (int)value - (int)(fix->org + 2);
+				if (offs < -128)
+					asm_error(&fctx, "backward branch of %d bytes is out of range by %d bytes", -offs, -offs - 128);
+				else if (offs > 127)
+					asm_error(&fctx, "forward branch of %d bytes is out of range by %d bytes", offs, offs - 127);
+				bytes[0] = offs;
+				width = 1;
+			}
+			break;
+	}
+	if (!err_message && fix->posn >= 0) {
+		fseek(obj_fp, fix->posn, SEEK_SET);
+		for (unsigned count = fix->count; count; --count)
+			fwrite(bytes, width, 1, obj_fp);
+	}
+	if (err_message) {
+		free(err_message);
+		err_message = NULL;
+	}
+}
+
+void fixup_resolve(void)
+{
+	struct fixup *fix = fix_head;
+	if (!fix)
+		return;
+	for (; fix; fix = fix->next)
+		fixup_one(fix);
+	fix_head = NULL;
+	fix_tail = &fix_head;
+	if (obj_fp)
+		fseek(obj_fp, 0, SEEK_END);
+}
@@ -1,15 +1,19 @@
 #define _GNU_SOURCE
 #include "laxasm.h"
 #include <errno.h>
-#include <search.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 static const char *list_filename = NULL;
 static const char *obj_filename = NULL;
-static unsigned err_count, err_column, cond_level, mac_count, mac_no;
-static bool swift_sym = false, mac_expand = false;
-static uint8_t cond_stack[32];
+static unsigned err_count, err_column, cond_level, mac_count, mac_no, pass_count;
+static unsigned drift_count;
+static struct symbol *drift_sym;
+static uint16_t drift_from, drift_to;
+static bool swift_sym = false, mac_expand = false, prefetch = false, verbose = false;
+static bool err_quiet, drift_redo, drift_final;
+static uint8_t *cond_stack;
+static unsigned cond_alloc;
 
 char *err_message = NULL, list_char;
 FILE *obj_fp = NULL, *list_fp = NULL;
@@ -17,20 +21,53 @@ unsigned passno, scope_no, list_opts = 0;
 unsigned page_len = 66, page_width = 132, cur_page, cur_line, tab_stops[MAX_TAB_STOPS];
 const unsigned default_tabs[MAX_TAB_STOPS] = { 8, 16, 25, 33, 41, 49, 57, 65, 73, 81, 89, 97, 115, 123 };
 uint16_t org, org_code, org_dsect, list_value, load_addr = 0, exec_addr = 0, addr_msw = 0;
-bool no_cmos = false, in_dsect, in_ds, codefile, cond_skipping, wend_skipping;
+bool no_cmos = false, in_dsect, in_ds, codefile, cond_skipping, wend_skipping, pass_defines;
 struct dstring objcode, title;
+struct codeslice code_slice;
 struct symbol *macsym = NULL;
 
 void asm_error(struct inctx *inp, const char *fmt, ...)
 {
 	if (!err_message) {
 		va_list ap;
-		++err_count;
 		err_column = inp->lineptr - inp->line.str;
 		va_start(ap, fmt);
 		vasprintf(&err_message, fmt, ap);
 		va_end(ap);
-		fprintf(stderr, "%s:%u:%d: %s\n", inp->name, inp->lineno, err_column, err_message);
+		if (!err_quiet) {
+			++err_count;
+			fprintf(stderr, "%s:%u:%d: %s\n", inp->name, inp->lineno, err_column, err_message);
+		}
+	}
+}
+
+/*
+ * A symbol defined on an earlier pass has been given a different value
+ * on this one, usually because an instruction before it that refers
+ * forward has changed size.  While sizing this just means another pass
+ * is needed.  If it happens while the code is being output and there
+ * have been no other errors the pass is finished quietly and then
+ * repeated once the addresses have settled; on the last pass allowed
+ * it is an error.  A symbol assigned with = may hold several values
+ * during a pass so it is not checked.
+ */
+
+void asm_drift(struct inctx *inp, struct symbol *sym, uint16_t value)
+{
+	if (sym->assigned)
+		return;
+	if (!drift_count++) {
+		drift_sym = sym;
+		drift_from = sym->value;
+		drift_to = value;
+		if (passno) {
+			if (drift_final || err_count)
+				asm_error(inp, "phase error: %s was &%04X on the previous pass, now &%04X", sym->name, sym->value, value);
+			else {
+				drift_redo = true;
+				err_quiet = true;
+			}
+		}
 	}
 }
 
@@ -73,11 +110,11 @@ static void list_pagecheck(struct inctx *inp)
 	}
 }
 
-static void list_extra(struct inctx *inp)
+static void list_extra(struct inctx *inp, const uint8_t *bytes, size_t size)
 {
-	unsigned togo = objcode.used - 3;
+	size_t togo = size - 3;
 	unsigned addr = org + 3;
-	uint8_t *bytes = (uint8_t *)objcode.str + 3;
+	bytes += 3;
 	while (togo >= 3) {
 		list_pagecheck(inp);
 		fprintf(list_fp, "%04X: %02X %02X %02X\n", addr, bytes[0], bytes[1], bytes[2]);
@@ -105,11 +142,16 @@ void list_line(struct inctx *inp)
 {
 	if (passno && list_fp) {
 		bool skipping = cond_skipping || inp->wend_skipping;
+		const uint8_t *bytes = (uint8_t *)objcode.str;
+		size_t size = objcode.used;
+		if (codefile) {
+			bytes = code_slice.bytes;
+			size = code_slice.size;
+		}
 		if (err_message || !(skipping && (list_opts & LISTO_SKIPPED))) {
 			if (list_opts & LISTO_ENABLED && !(list_opts & LISTO_MACRO && inp->whence == 'M')) {
 				list_pagecheck(inp);
-				uint8_t *bytes = (uint8_t *)objcode.str;
-				switch(objcode.used) {
+				switch(size) {
 					case 0:
 						fprintf(list_fp, "%04X%c          ", list_value & 0xffff, list_char);
 						break;
@@ -134,7 +176,7 @@ void list_line(struct inctx *inp)
 					unsigned col = 0;
 					const char *ptr = inp->line.str;
 					size_t remain = inp->line.used;
-					const char *tab = memchr(ptr, '\t', remain);
+					const char *tab = (inp->flags & LINE_TAB) ? memchr(ptr, '\t', remain) : NULL;
 					if (tab) {
 						int tab_no = 0;
 						do {
@@ -173,18 +215,114 @@ void list_line(struct inctx *inp)
 				list_pagecheck(inp);
 				fprintf(list_fp, "+++ERROR at character %d: %s\n", err_column, err_message);
 			}
-			if (objcode.used > 3 && (list_opts & LISTO_ALLCODE) && (!codefile || (list_opts & LISTO_CODEFILE)))
-				list_extra(inp);
+			if (size > 3 && (list_opts & LISTO_ALLCODE) && (!codefile || (list_opts & LISTO_CODEFILE)))
+				list_extra(inp, bytes, size);
 		}
 	}
 }
 
+/* Whether an '@' followed by this character can be substituted without evaluating anything. */
+
+static bool asm_macsimple(int ch)
+{
+	return asm_isdigit(ch) || (ch >= 'A' && ch <= 'J') || (ch >= 'a' && ch <= 'j') || ch == 'N' || ch == 'n';
+}
+
+static void asm_maccompile(struct macbody *mb)
+{
+	const char *text = mb->text;
+	const char *end = text + mb->length;
+	const char *start = text;
+	const char *at = (mb->flags & LINE_AT) ? memchr(text, '@', mb->length) : NULL;
+	unsigned nat = 0;
+	mb->argsonly = true;
+	for (const char *p = at; p; p = memchr(p + 1, '@', end - p - 1))
+		++nat;
+	struct macseg *segs = arena_alloc(&run_arena, (2 * nat + 1) * sizeof(struct macseg));
+	struct macseg *seg = segs;
+	while (at) {
+		if (at > start) {
+			seg->kind = SEG_TEXT;
+			seg->start = start - text;
+			seg->len = at - start;
+			++seg;
+		}
+		const char *p = at + 1;
+		uint8_t wantlen = 0;
+		if (p < end && *p == '?') {
+			wantlen = SEG_LEN;
+			++p;
+		}
+		int ch = p < end ? *p : 0;
+		if (!asm_macsimple(ch)) {
+			mb->argsonly = false;
+			seg->kind = SEG_REST;
+			seg->start = at - text;
+			seg->len = end - at;
+			++seg;
+			start = end;
+			break;
+		}
+		if (asm_isdigit(ch)) {
+			seg->kind = (ch == '0' ? SEG_MACNO : SEG_ARG) | wantlen;
+			seg->argno = ch - '1';
+			if (ch == '0')
+				mb->argsonly = false;
+		}
+		else if (ch == 'N' || ch == 'n')
+			seg->kind = SEG_NARG | wantlen;
+		else if ((ch & 0x1f) == 1) {
+			seg->kind = SEG_MACNO | SEG_LEN;
+			mb->argsonly = false;
+		}
+		else {
+			seg->kind = SEG_ARG | SEG_LEN;
+			seg->argno = (ch & 0x1f) - 2;
+		}
+		++seg;
+		start = p + 1;
+		at = memchr(start, '@', end - start);
+	}
+	if (start < end) {
+		seg->kind = SEG_TEXT;
+		seg->start = start - text;
+		seg->len = end - start;
+		++seg;
+	}
+	mb->segs = segs;
+	mb->nsegs = seg - segs;
+}
+
+#define MACBODY_HASH 1024
+
+static struct macbody *mac_bodies[MACBODY_HASH];
+
+static struct macbody *asm_macbody(const char *text, size_t length, uint8_t flags)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i)
+		hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+	struct macbody **chain = mac_bodies + (hash & (MACBODY_HASH - 1));
+	for (struct macbody *mb = *chain; mb; mb = mb->hnext)
+		if (mb->length == length && mb->flags == flags && !memcmp(mb->text, text, length))
+			return mb;
+	struct macbody *mb = arena_alloc(&run_arena, sizeof(struct macbody) + length);
+	memset(&mb->ir, 0, sizeof(mb->ir));
+	mb->flags = flags;
+	mb->length = length;
+	memcpy(mb->text, text, length);
+	asm_maccompile(mb);
+	mb->hnext = *chain;
+	*chain = mb;
+	return mb;
+}
+
 static enum action asm_macdef(struct inctx *inp, int ch, size_t label_size)
 {
 	/* defining a MACRO - check for the end marker */
 	const char *p = inp->lineptr;
 	if ((ch == 'E' || ch == 'e') && (p[1] == 'N' || p[1] == 'n') && (p[2] == 'D' || p[2] == 'd') && (p[3] == 'M' || p[3] == 'm')) {
-		if (!passno) {
+		if (pass_defines) {
 			/* put the lines back in the right order */
 			struct macline *current = macsym->macro;
 			struct macline *prev = NULL, *after = NULL;
@@ -195,19 +333,17 @@ static enum action asm_macdef(struct inctx *inp, int ch, size_t label_size)
 				current = after;
 			}
 			macsym->macro = prev;
+			unsigned index = 0;
+			for (current = prev; current; current = current->next)
+				current->index = index++;
 		}
 		macsym = NULL; /* no longer defining */
 	}
-	else if (!passno) { /* macros only defined on pass one */
-		struct macline *ml = malloc(sizeof(struct macline) + inp->line.used);
-		if (ml) {
-			ml->next = macsym->macro;
-			macsym->macro = ml;
-			ml->length = inp->line.used;
-			memcpy(ml->text, inp->line.str, inp->line.used);
-		}
-		else
-			asm_error(inp, "out of memory defining macro %s", macsym->name);
+	else if (pass_defines) { /* macros only defined on pass one */
+		struct macline *ml = arena_alloc(&run_arena, sizeof(struct macline));
+		ml->next = macsym->macro;
+		macsym->macro = ml;
+		ml->body = asm_macbody(inp->line.str, inp->line.used, inp->flags);
 	}
 	list_line(inp);
 	return ACT_CONTINUE;
@@ -251,25 +387,30 @@ static void asm_macparse(struct inctx *inp, struct macro_args *args)
 		++pno;
 	}
 	for (int fno = pno; fno < 10; ++fno) {
-		args->text[pno] = inp->lineptr;
-		args->lens[pno] = 0;
+		args->text[fno] = inp->lineptr;
+		args->lens[fno] = 0;
 	}
 	args->narg = pno;
 }
 
 static enum action asm_line(struct inctx *inp);
 
-static enum action asm_macsubst(struct inctx *mctx, struct inctx *sctx, struct macro_args *args, char *at)
+/*
+ * Substitute the arguments in the rest of a macro line from an '@' on,
+ * evaluating any expressions in the substitutions, returning false if
+ * there is an error.
+ */
+
+static bool asm_macsubst(struct inctx *mctx, struct inctx *sctx, struct macro_args *args, char *at)
 {
-	const char *start = mctx->line.str;
-	const char *end = start + mctx->line.used;
-	sctx->line.used = 0;
+	const char *start = at;
+	const char *end = mctx->line.str + mctx->line.used;
 	do {
 		dstr_add_bytes(&sctx->line, start, at - start);
 		bool wantlen = false;
 		int len, sub_start = 0, sub_len = -1;
 		int argno, ch = *++at;
-		char numbuf[6], *base;
+		char numbuf[12], *base;
 		if (ch == '?') {
 			wantlen = true;
 			ch = *++at;
@@ -279,18 +420,18 @@ static enum action asm_macsubst(struct inctx *mctx, struct inctx *sctx, struct m
 			/* take a sub-string */
 			sub_start = expression(mctx, true) - 1;
 			if (err_message)
-				return ACT_CONTINUE;
+				return false;
 			ch = *mctx->lineptr;
 			if (ch == ',') {
 				++mctx->lineptr;
 				sub_len = expression(mctx, true);
 				if (err_message)
-					return ACT_CONTINUE;
+					return false;
 				ch = *mctx->lineptr;
 			}
 			if (ch != ')') {
 				asm_error(mctx, "missing ) in macro argument");
-				return ACT_CONTINUE;
+				return false;
 			}
 			at = ++mctx->lineptr;
 			ch = *at;
@@ -299,18 +440,18 @@ static enum action asm_macsubst(struct inctx *mctx, struct inctx *sctx, struct m
 			/* argument number is given by an expression */
 			argno = expression(mctx, true);
 			if (err_message)
-				return ACT_CONTINUE;
+				return false;
 			if (*mctx->lineptr != ']') {
 				asm_error(mctx, "missing ] in macro argument");
-				return ACT_CONTINUE;;
+				return false;
 			}
 			if (argno < 0 || argno > 9) {
 				asm_error(mctx, "invalid macro argument number %d", argno);
-				return ACT_CONTINUE;;
+				return false;
 			}
 			at = mctx->lineptr;
 		}
-		else if (ch >= '0' && ch <= '9')
+		else if (asm_isdigit(ch))
 			argno = ch - '0';
 		else if (ch >= 'A' && ch <= 'J') {
 			wantlen = true;
@@ -324,7 +465,7 @@ static enum action asm_macsubst(struct inctx *mctx, struct inctx *sctx, struct m
 			argno = -1;
 		else {
 			asm_error(mctx, "invalid macro argument @%c", ch);
-			return ACT_CONTINUE;
+			return false;
 		}
 		if (argno == -1) {
 			base = numbuf;
@@ -344,6 +485,8 @@ static enum action asm_macsubst(struct inctx *mctx, struct inctx *sctx, struct m
 			len = snprintf(numbuf, sizeof(numbuf), "%d", len);
 		}
 		if (sub_start > 0) {
+			if (sub_start > len)
+				sub_start = len;
 			base += sub_start;
 			len -= sub_start;
 		}
@@ -356,74 +499,312 @@ static enum action asm_macsubst(struct inctx *mctx, struct inctx *sctx, struct m
 	while (at);
 	if (start < end)
 		dstr_add_bytes(&sctx->line, start, end - start);
+	return true;
+}
+
+static void asm_macnum(struct inctx *sctx, const char *fmt, int value)
+{
+	char numbuf[12];
+	int len = snprintf(numbuf, sizeof(numbuf), fmt, value);
+	dstr_add_bytes(&sctx->line, numbuf, len);
+}
+
+/* Substitute the arguments into a macro line, returning false if there is an error. */
+
+static bool asm_macsegs(struct inctx *mctx, struct inctx *sctx, struct macro_args *args, const struct macbody *mb)
+{
+	sctx->line.used = 0;
+	const struct macseg *seg = mb->segs;
+	const struct macseg *end = seg + mb->nsegs;
+	for (; seg < end; ++seg) {
+		int len;
+		switch(seg->kind) {
+			case SEG_TEXT:
+				dstr_add_bytes(&sctx->line, mb->text + seg->start, seg->len);
+				break;
+			case SEG_ARG:
+				dstr_add_bytes(&sctx->line, args->text[seg->argno], args->lens[seg->argno]);
+				break;
+			case SEG_ARG|SEG_LEN:
+				asm_macnum(sctx, "%d", args->lens[seg->argno]);
+				break;
+			case SEG_MACNO:
+				asm_macnum(sctx, "%05d", mac_no);
+				break;
+			case SEG_MACNO|SEG_LEN:
+				len = snprintf(NULL, 0, "%05d", mac_no);
+				asm_macnum(sctx, "%d", len);
+				break;
+			case SEG_NARG:
+				asm_macnum(sctx, "%d", args->narg);
+				break;
+			case SEG_NARG|SEG_LEN:
+				len = snprintf(NULL, 0, "%d", args->narg);
+				asm_macnum(sctx, "%d", len);
+				break;
+			case SEG_REST:
+				if (!asm_macsubst(mctx, sctx, args, mctx->line.str + seg->start))
+					return false;
+				break;
+		}
+	}
+	return true;
+}
+
+/*
+ * Expansions of a macro with the same arguments give the same lines,
+ * other than those using @0 or substitutions that evaluate expressions,
+ * so each line substituted is kept, keyed on the macro and the text of
+ * the arguments, as a macro body line.  When the macro is called with
+ * the same arguments again, including on the next pass, the kept line
+ * is assembled, with its opcode, symbols and expressions already looked
+ * up and compiled, rather than being substituted again.  Only the text
+ * is kept, not values or code, so symbols changing with '=' between
+ * calls need nothing discarding.
+ */
+
+struct macexp {
+	struct macexp *hnext;
+	struct symbol *mac;
+	uint32_t hash;
+	int narg;
+	int lens[10];
+	const char *text[10];
+	struct macbody *lines[];
+};
+
+#define MACEXP_HASH 4096
+#define MACEXP_MAX  65536
+
+static struct macexp *mac_exps[MACEXP_HASH];
+static unsigned long mac_exp_count, mac_hits, mac_misses;
+
+static struct macexp *asm_macexp(struct symbol *mac, const struct macro_args *args)
+{
+	uint32_t hash = 2166136261u;
+	uintptr_t key = (uintptr_t)mac;
+	for (int i = 0; i < sizeof(key); ++i, key >>= 8)
+		hash = (hash ^ (key & 0xff)) * 16777619u;
+	hash = (hash ^ args->narg) * 16777619u;
+	for (int i = 0; i < args->narg; ++i) {
+		hash = (hash ^ args->lens[i]) * 16777619u;
+		for (int j = 0; j < args->lens[i]; ++j)
+			hash = (hash ^ (uint8_t)args->text[i][j]) * 16777619u;
+	}
+	struct macexp **chain = mac_exps + (hash & (MACEXP_HASH - 1));
+	for (struct macexp *me = *chain; me; me = me->hnext) {
+		if (me->hash == hash && me->mac == mac && me->narg == args->narg) {
+			int i = 0;
+			while (i < args->narg && me->lens[i] == args->lens[i] && !memcmp(me->text[i], args->text[i], args->lens[i]))
+				++i;
+			if (i == args->narg) {
+				++mac_hits;
+				return me;
+			}
+		}
+	}
+	++mac_misses;
+	if (mac_exp_count >= MACEXP_MAX)
+		return NULL;
+	unsigned nlines = 0;
+	for (struct macline *ml = mac->macro; ml; ml = ml->next)
+		++nlines;
+	struct macexp *me = arena_alloc(&run_arena, sizeof(struct macexp) + nlines * sizeof(struct macbody *));
+	me->mac = mac;
+	me->hash = hash;
+	me->narg = args->narg;
+	for (int i = 0; i < args->narg; ++i) {
+		me->lens[i] = args->lens[i];
+		me->text[i] = arena_strndup(&run_arena, args->text[i], args->lens[i]);
+	}
+	memset(me->lines, 0, nlines * sizeof(struct macbody *));
+	me->hnext = *chain;
+	*chain = me;
+	++mac_exp_count;
+	return me;
+}
+
+/* Expand a macro line that has arguments to be substituted. */
+
+static enum action asm_macline(struct inctx *mctx, struct inctx *sctx, struct macro_args *args, struct macexp *me, const struct macline *ml)
+{
+	const struct macbody *mb = ml->body;
+	if (me && mb->argsonly) {
+		struct macbody *sb = me->lines[ml->index];
+		if (!sb) {
+			asm_macsegs(mctx, sctx, args, mb);
+			sb = me->lines[ml->index] = asm_macbody(sctx->line.str, sctx->line.used, sctx->flags);
+		}
+		/* assemble the kept line in place of the substitution buffer */
+		struct dstring save = sctx->line;
+		sctx->line.str = sctx->lineptr = sb->text;
+		sctx->line.used = sb->length;
+		sctx->line.allocated = 0;
+		sctx->ir = &sb->ir;
+		enum action act = asm_line(sctx);
+		sctx->ir = NULL;
+		sctx->line = save;
+		return act;
+	}
+	if (!asm_macsegs(mctx, sctx, args, mb))
+		return ACT_CONTINUE;
 	sctx->lineptr = sctx->line.str;
 	return asm_line(sctx);
 }
 
+
+/*
+ * Each macro expansion and INCLUDE file nested inside another takes a
+ * frame from a stack kept on the heap rather than putting its input
+ * contexts, arguments and substitution buffer on the C stack.  Frames
+ * are kept once allocated, so the frame at each depth, and the buffer
+ * it has grown for substituted lines, is reused by every expansion at
+ * that depth, and the depth is limited so that runaway recursion gives
+ * an error rather than exhausting the C stack.
+ */
+
+struct expframe {
+	struct inctx mctx;      /* macro body lines, or the INCLUDE file */
+	struct inctx sctx;      /* lines with arguments substituted */
+	struct macro_args args;
+};
+
+#define DEFAULT_DEPTH 1000
+#define MAX_DEPTH     10000
+
+static struct expframe **exp_stack;
+static unsigned exp_depth, exp_alloc, max_depth = DEFAULT_DEPTH;
+static bool exp_unwinding;  /* the limit was reached so abandon the expansions */
+
+static struct expframe *asm_nest(struct inctx *inp)
+{
+	if (exp_depth >= max_depth) {
+		asm_error(inp, "macro calls and INCLUDE files nested more than %u deep", max_depth);
+		exp_unwinding = true;
+		return NULL;
+	}
+	if (exp_depth == exp_alloc) {
+		unsigned alloc = exp_alloc ? exp_alloc * 2 : 16;
+		struct expframe **stack = realloc(exp_stack, alloc * sizeof(struct expframe *));
+		if (!stack) {
+			asm_error(inp, "out of memory for nested macro calls");
+			return NULL;
+		}
+		memset(stack + exp_alloc, 0, (alloc - exp_alloc) * sizeof(struct expframe *));
+		exp_stack = stack;
+		exp_alloc = alloc;
+	}
+	struct expframe *ef = exp_stack[exp_depth];
+	if (!ef) {
+		if (!(ef = malloc(sizeof(struct expframe)))) {
+			asm_error(inp, "out of memory for nested macro calls");
+			return NULL;
+		}
+		dstr_empty(&ef->sctx.line, 0);
+		exp_stack[exp_depth] = ef;
+	}
+	++exp_depth;
+	return ef;
+}
+
+/* An input context for an INCLUDE file, released with asm_unnest. */
+
+struct inctx *asm_nest_file(struct inctx *inp)
+{
+	struct expframe *ef = asm_nest(inp);
+	return ef ? &ef->mctx : NULL;
+}
+
+void asm_unnest(void)
+{
+	if (--exp_depth == 0)
+		exp_unwinding = false;
+}
+
+static void asm_free_frames(void)
+{
+	for (unsigned i = 0; i < exp_alloc; ++i) {
+		if (exp_stack[i]) {
+			free(exp_stack[i]->sctx.line.str);
+			free(exp_stack[i]);
+		}
+	}
+	free(exp_stack);
+}
+
 static void mac_init_ctx(struct inctx *parent, struct inctx *child)
 {
-	dstr_empty(&child->line, 0);
-	dstr_empty(&child->wcond, 0);
+	child->wcond = NULL;
 	child->parent = parent;
-	child->fp = NULL;
+	child->src = NULL;
+	child->ir = NULL;
+	child->flags = LINE_ANY;
 	child->name = parent->name;
 	child->lineno = parent->lineno;
 	child->whence = 'M';
-	child->wcond.used = 0;
 	child->rpt_line = 0;
 	child->wend_skipping = false;
 }
 
 static void asm_macexpand(struct inctx *inp, struct symbol *mac)
 {
-	if (mac->scope == SCOPE_MACRO) {
-		unsigned save_mac_no = mac_no;
-		bool save_mac_expand = mac_expand;
+	struct expframe *ef;
+	if (mac->scope != SCOPE_MACRO) {
+		asm_error(inp, "%s is a value, not a MACRO", mac->name);
+		list_line(inp);
+	}
+	else if (!(ef = asm_nest(inp)))
+		list_line(inp);
+	else {
+		unsigned save_mac_no = mac_no, save_level = cond_level;
+		bool save_mac_expand = mac_expand, save_skipping = cond_skipping;
 		mac_expand = true;
 		mac_no = mac_count++;
-		struct macro_args args;
-		asm_macparse(inp, &args);
+		struct macro_args *args = &ef->args;
+		asm_macparse(inp, args);
+		struct macexp *me = err_message ? NULL : asm_macexp(mac, args);
 		list_line(inp);
 
 		/* Set up an input context for non-subsutited lines. */
-		struct inctx mctx;
-		mac_init_ctx(inp, &mctx);
+		struct inctx *mctx = &ef->mctx;
+		mac_init_ctx(inp, mctx);
+		mctx->line.allocated = 0;
 
 		/* Set up an input context for subsutited lines. */
-		struct inctx sctx;
-		mac_init_ctx(&mctx, &sctx);
+		struct inctx *sctx = &ef->sctx;
+		mac_init_ctx(mctx, sctx);
 
 		/* step through each line */
 		for (struct macline *ml = mac->macro; ml; ml = ml->next) {
-			mctx.line.str = mctx.lineptr = ml->text;
-			mctx.line.used = ml->length;
+			struct macbody *mb = ml->body;
+			mctx->line.str = mctx->lineptr = mb->text;
+			mctx->line.used = mb->length;
+			mctx->flags = mb->flags;
 			enum action act;
 			/* does the line have args to be subsitited? */
-			char *at = memchr(ml->text, '@', ml->length);
-			if (at)
-				act = asm_macsubst(&mctx, &sctx, &args, at);
-			else
-				act = asm_line(&mctx);
-			if (act == ACT_STOP)
+			if (mb->nsegs > 1 || (mb->nsegs && mb->segs->kind != SEG_TEXT))
+				act = asm_macline(mctx, sctx, args, me, ml);
+			else {
+				mctx->ir = &mb->ir;
+				act = asm_line(mctx);
+				mctx->ir = NULL;
+			}
+			if (act == ACT_STOP || exp_unwinding)
 				break;
 			else if (act == ACT_RMARK)
-				mctx.mpos = ml;
+				mctx->mpos = ml;
 			else if (act == ACT_RBACK)
-				ml = mctx.mpos;
-		}
-		if (mctx.wcond.allocated)
-			free(mctx.wcond.str);
-		if (sctx.line.allocated)
-			free(sctx.line.str);
-		if (sctx.wcond.allocated)
-			free(sctx.wcond.str);
+				ml = mctx->mpos;
+		}
+		if (exp_unwinding && cond_level > save_level) {
+			/* the IFs in the abandoned lines will not see their FIs */
+			cond_level = save_level;
+			cond_skipping = save_skipping;
+		}
 		if (save_mac_expand)
 			mac_no = save_mac_no;
 		mac_expand = save_mac_expand;
-	}
-	else {
-		asm_error(inp, "%s is a value, not a MACRO", mac->name);
-		list_line(inp);
+		asm_unnest();
 	}
 }
 
@@ -433,7 +814,16 @@ static void asm_macexpand(struct inctx *inp, struct symbol *mac)
 
 static void asm_if(struct inctx *inp, int iftype)
 {
-	if (cond_level == (sizeof(cond_stack)-1))
+	if (cond_level == cond_alloc) {
+		/* nesting grows with recursive macros so is not fixed */
+		unsigned alloc = cond_alloc ? cond_alloc * 2 : 32;
+		uint8_t *stack = realloc(cond_stack, alloc);
+		if (stack) {
+			cond_stack = stack;
+			cond_alloc = alloc;
+		}
+	}
+	if (cond_level == cond_alloc)
 		asm_error(inp, "Too many levels of IF");
 	else {
 		cond_stack[cond_level++] = cond_skipping;
@@ -442,10 +832,9 @@ static void asm_if(struct inctx *inp, int iftype)
 			if (iftype == IF_EXPR)
 				value = expression(inp, true);
 			else {
-				if (symbol_lookup(inp, true) && iftype == IF_DEF)
-					value = -1;
-				else
-					value = 0;
+				non_space(inp);
+				bool defined = symbol_defined(inp);
+				value = (defined == (iftype == IF_DEF)) ? -1 : 0;
 			}
 			list_value = value;
 			list_char = '=';
@@ -482,15 +871,15 @@ static enum action asm_wend(struct inctx *inp)
 	if (inp->wend_skipping)
 		inp->wend_skipping = false;
 	else if (inp->rpt_line) {
-		if (inp->wcond.used) {
+		if (inp->wcond) {
 			struct inctx wctx;
+			wctx.ir = NULL;
 			wctx.name = inp->name;
 			wctx.lineno = inp->rpt_line;
-			wctx.lineptr = inp->wcond.str;
-			int value = expression(&wctx, true);
+			int value = expr_again(&wctx, inp->wcond, true);
 			if (value)
 				return ACT_RBACK;
-			inp->wcond.used = 0;
+			inp->wcond = NULL;
 			inp->rpt_line = 0;
 		}
 		else
@@ -501,24 +890,177 @@ static enum action asm_wend(struct inctx *inp)
 	return ACT_CONTINUE;
 }
 
+static const struct {
+	char name[8];
+	uint8_t kind;
+} asm_keywords[] = {
+	{ "MACRO",   OP_MACRO   },
+	{ "IF",      OP_IF      },
+	{ "IFDEF",   OP_IFDEF   },
+	{ "IFNDEF",  OP_IFNDEF  },
+	{ "ELSE",    OP_ELSE    },
+	{ "FI",      OP_FI      },
+	{ "FIN",     OP_FI      },
+	{ "WEND",    OP_WEND    },
+	{ "INCLUDE", OP_INCLUDE }
+};
+
+/*
+ * Every word that may appear in the opcode field other than the name of
+ * a macro, the keywords above, the 6502 mnemonics and the directives,
+ * is kept in one table keyed by the word packed into an integer.  The
+ * table is built as the assembler starts from the tables of each module
+ * so they cannot disagree, with a multiplier chosen so that no two
+ * words hash to the same slot, so finding a word is one multiply, one
+ * index and one compare however many there are.  Where a word is in
+ * more than one table the first entered wins, which gives the same
+ * precedence as the order the operations are dispatched in, so a MACRO
+ * with the same name as a mnemonic or directive is never called.
+ */
+
+struct opword {
+	uint64_t key;
+	uint8_t kind;
+	const void *ptr;
+};
+
+#define OPWORD_MAX  256
+#define OPWORD_BITS 11
+
+static struct opword opwords[OPWORD_MAX];
+static unsigned opword_count, opword_bits;
+static uint16_t *opword_slots;
+static uint64_t opword_mult;
+
+static uint64_t opword_key(const char *name, size_t size)
+{
+	uint64_t key = 0;
+	memcpy(&key, name, size);
+	return key;
+}
+
+static inline unsigned opword_hash(uint64_t key)
+{
+	return (key * opword_mult) >> (64 - opword_bits);
+}
+
+void asm_opword(const char *name, enum opkind kind, const void *ptr)
+{
+	size_t size = strnlen(name, sizeof(uint64_t) + 1);
+	if (size > sizeof(uint64_t)) {
+		fprintf(stderr, "laxasm: opcode word %.*s... is too long\n", (int)sizeof(uint64_t), name);
+		exit(1);
+	}
+	uint64_t key = opword_key(name, size);
+	for (unsigned i = 0; i < opword_count; ++i)
+		if (opwords[i].key == key)
+			return;
+	if (opword_count >= OPWORD_MAX) {
+		fprintf(stderr, "laxasm: too many opcode words\n");
+		exit(1);
+	}
+	struct opword *ow = opwords + opword_count++;
+	ow->key = key;
+	ow->kind = kind;
+	ow->ptr = ptr;
+}
+
+static void opword_build(void)
+{
+	for (int i = 0; i < sizeof(asm_keywords) / sizeof(asm_keywords[0]); ++i)
+		asm_opword(asm_keywords[i].name, asm_keywords[i].kind, NULL);
+	m6502_opwords();
+	pseudo_opwords();
+
+	uint64_t seed = 0x9e3779b97f4a7c15;
+	for (opword_bits = OPWORD_BITS; ; ++opword_bits) {
+		size_t size = (size_t)1 << opword_bits;
+		opword_slots = realloc(opword_slots, size * sizeof(uint16_t));
+		if (!opword_slots) {
+			fprintf(stderr, "laxasm: out of memory building opcode table\n");
+			exit(1);
+		}
+		for (int tries = 0; tries < 64; ++tries) {
+			/* odd multipliers from a fixed sequence so every run agrees */
+			seed = seed * 6364136223846793005 + 1442695040888963407;
+			opword_mult = seed | 1;
+			memset(opword_slots, 0, size * sizeof(uint16_t));
+			unsigned i;
+			for (i = 0; i < opword_count; ++i) {
+				uint16_t *slot = opword_slots + opword_hash(opwords[i].key);
+				if (*slot)
+					break;
+				*slot = i + 1;
+			}
+			if (i == opword_count)
+				return;
+		}
+	}
+}
+
+/* Work out what kind of operation is named by an opcode word. */
+
+static void asm_classify(struct lineir *ir, const char *opname, size_t opsize)
+{
+	if (opsize == 0)
+		ir->kind = OP_NONE;
+	else {
+		if (opsize <= sizeof(uint64_t)) {
+			char word[sizeof(uint64_t)];
+			for (size_t i = 0; i < opsize; ++i)
+				word[i] = asm_toupper(opname[i]);
+			uint64_t key = opword_key(word, opsize);
+			unsigned slot = opword_slots[opword_hash(key)];
+			if (slot && opwords[slot-1].key == key) {
+				const struct opword *ow = opwords + slot - 1;
+				ir->kind = ow->kind;
+				if (ow->kind == OP_M6502)
+					ir->opc = ow->ptr;
+				else
+					ir->pseudo = ow->ptr;
+				return;
+			}
+		}
+		if ((ir->macro = symbol_macfind(opname, opsize)))
+			ir->kind = OP_MACCALL;
+		else
+			ir->kind = OP_OTHER;
+	}
+}
+
 static enum action asm_operation(struct inctx *inp, int ch, size_t label_size)
 {
 	enum action act = ACT_CONTINUE;
+	struct lineir op, *ir = inp->ir;
 	char *ptr = inp->lineptr;
-	while (!asm_isspace(ch) && !asm_isendchar(ch))
-		ch = *++ptr;
-	size_t opsize = ptr - inp->lineptr;
-	inp->lineptr = ptr;
-	char opname[opsize+1], *nptr = opname + opsize;
-	*nptr = 0;
-	while (nptr > opname) {
-		ch = *--ptr;
-		if (ch >= 'a' && ch <= 'z')
-			ch &= 0xdf;
-		*--nptr = ch;
+	if (ir && ir->kind) {
+		op = *ir;
+		inp->lineptr = ptr + op.opsize;
+	}
+	else {
+		while (!asm_isdelim(ch))
+			ch = *++ptr;
+		size_t opsize = ptr - inp->lineptr;
+		size_t opstart = inp->lineptr - inp->line.str;
+		asm_classify(&op, inp->lineptr, opsize);
+		inp->lineptr += opsize;
+		op.label_size = label_size;
+		op.opstart = opstart;
+		op.opsize = opsize;
+		/*
+		 * Remember what was found if the line will be seen again.
+		 * An unrecognised opcode is not remembered as it may yet
+		 * be defined as a MACRO.
+		 */
+		if (ir && op.kind != OP_OTHER && label_size <= 0xffff && opstart <= 0xffff && opsize <= 0xffff) {
+			op.nrefs = ir->nrefs;
+			op.refs = ir->refs;
+			op.exprs = ir->exprs;
+			*ir = op;
+		}
 	}
 	bool skipping = cond_skipping || inp->wend_skipping;
-	if (!skipping && opsize == 5 && !strncmp(opname, "MACRO", opsize)) {
+	if (!skipping && op.kind == OP_MACRO) {
 		if (macsym)
 			asm_error(inp, "no nested MACROs, %s is being defined", macsym->name);
 		else if (label_size) {
@@ -528,7 +1070,7 @@ static enum action asm_operation(struct inctx *inp, int ch, size_t label_size)
 				struct symbol *sym = symbol_enter(inp, label_size, SCOPE_MACRO, false);
 				if (sym) {
 					macsym = sym;
-					if (!passno)
+					if (pass_defines)
 						sym->macro = NULL;
 				}
 			}
@@ -541,59 +1083,72 @@ static enum action asm_operation(struct inctx *inp, int ch, size_t label_size)
 		struct symbol *sym = NULL;
 		if (!skipping && label_size) {
 			int scope = *inp->line.str == ':' ? scope_no : SCOPE_GLOBAL;
-			if (opsize == 1 && *opname == '=') {
+			if (op.kind == OP_ASSIGN) {
 				if ((sym = symbol_enter(inp, label_size, scope, true))) {
-					uint16_t value = expression(inp, passno);
-					sym->value = value;
+					uint16_t value = expression(inp, !pass_defines);
+					if (one_pass && expr_forward)
+						asm_error(inp, "forward reference in an assignment needs two passes");
+					sym->def = NULL;
+					sym->assigned = 1;
+					symbol_set(sym, value);
 					list_value = value;
 					list_char = '=';
 				}
 				list_line(inp);
 				return act;
 			}
-			if ((sym = symbol_enter(inp, label_size, scope, false)) && !passno)
-				sym->value = org;
-		}
-		if (opsize == 2 && !strncmp(opname, "IF", opsize))
-			asm_if(inp, IF_EXPR);
-		else if (opsize == 5 && !strncmp(opname, "IFDEF", opsize))
-			asm_if(inp, IF_DEF);
-		else if (opsize == 6 && !strncmp(opname, "IFNDEF", opsize))
-			asm_if(inp, IF_NDEF);
-		else if (opsize == 4 && !strncmp(opname, "ELSE", opsize))
-			asm_else(inp);
-		else if ((opsize == 2 && !strncmp(opname, "FI", opsize)) || (opsize == 3 && !strncmp(opname, "FIN", opsize))) {
-			if (!cond_level)
-				asm_error(inp, "FI without IF");
-			else
-				cond_skipping = cond_stack[--cond_level];
-			list_line(inp);
-		}
-		else if (opsize == 4 && !strncmp(opname, "WEND", opsize)) {
-			act = asm_wend(inp);
-			list_line(inp);
+			if ((sym = symbol_enter(inp, label_size, scope, false))) {
+				if (pass_defines)
+					sym->value = org;
+				else if (sym->value != org && !(op.kind == OP_PSEUDO && pseudo_sets_label(op.pseudo))) {
+					asm_drift(inp, sym, org);
+					symbol_set(sym, org);
+				}
+			}
 		}
-		else if (cond_skipping || inp->wend_skipping || opsize == 0 || (opsize == 3 && m6502_op(inp, opname)))
-			list_line(inp);
-		else if (opsize == 7 && !strncmp(opname, "INCLUDE", opsize))
-			act = pseudo_include(inp);
-		else {
-			act = pseudo_op(inp, opname, opsize, sym);
-			if (act == ACT_NOTFOUND) {
-				/* Not a pseudo-op, is it a MACRO? */
-				struct symbol sym;
-				sym.scope = SCOPE_MACRO;
-				sym.name = opname;
-				struct symbol **node = tfind(&sym, &symbols, symbol_cmp);
-				if (node)
-					asm_macexpand(inp, *node);
+		switch(op.kind) {
+			case OP_IF:
+				asm_if(inp, IF_EXPR);
+				break;
+			case OP_IFDEF:
+				asm_if(inp, IF_DEF);
+				break;
+			case OP_IFNDEF:
+				asm_if(inp, IF_NDEF);
+				break;
+			case OP_ELSE:
+				asm_else(inp);
+				break;
+			case OP_FI:
+				if (!cond_level)
+					asm_error(inp, "FI without IF");
+				else
+					cond_skipping = cond_stack[--cond_level];
+				list_line(inp);
+				break;
+			case OP_WEND:
+				act = asm_wend(inp);
+				list_line(inp);
+				break;
+			default:
+				if (skipping || op.kind == OP_NONE || op.kind == OP_MACRO)
+					list_line(inp);
+				else if (op.kind == OP_M6502) {
+					m6502_op(inp, op.opc);
+					list_line(inp);
+				}
+				else if (op.kind == OP_INCLUDE)
+					act = pseudo_include(inp);
+				else if (op.kind == OP_MACCALL)
+					asm_macexpand(inp, op.macro);
+				else if (op.kind == OP_OTHER) {
+					asm_error(inp, "unrecognised opcode '%s'", symbol_errname(inp->lineptr - op.opsize, op.opsize));
+					list_line(inp);
+				}
 				else {
-					asm_error(inp, "unrecognised opcode '%.*s'", (int)opsize, opname);
+					act = pseudo_op(inp, op.pseudo, sym);
 					list_line(inp);
 				}
-			}
-			else
-				list_line(inp);
 		}
 	}
 	return act;
@@ -605,9 +1160,15 @@ static enum action asm_line(struct inctx *inp)
 	list_char = ':';
 	size_t label_size = 0;
 	int ch = *inp->lineptr;
+	if (inp->ir && inp->ir->kind && !macsym) {
+		/* seen before so the label and opcode positions are known */
+		label_size = inp->ir->label_size;
+		inp->lineptr = inp->line.str + inp->ir->opstart;
+		ch = *inp->lineptr;
+	}
 	/* parse any label */
-	if (!asm_isspace(ch)) {
-		if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || ch == ':') {
+	else if (!asm_isspace(ch)) {
+		if (asm_isalpha(ch) || ch == ':') {
 			ch = symbol_parse(inp);
 			if (macsym)
 				while (ch == '@')
@@ -615,13 +1176,13 @@ static enum action asm_line(struct inctx *inp)
 			label_size = inp->lineptr - inp->line.str;
 			if (ch == ':')
 				++inp->lineptr;
-			else if (!asm_isspace(ch) && !asm_isendchar(ch)) {
+			else if (!asm_isdelim(ch)) {
 				asm_error(inp, "invalid character in label");
 				list_line(inp);
 				return ACT_CONTINUE;
 			}
 		}
-		else if (!asm_isspace(ch) && !asm_isendchar(ch)) {
+		else if (!asm_isdelim(ch)) {
 			asm_error(inp, "labels must start with a letter");
 			list_line(inp);
 			return ACT_CONTINUE;
@@ -646,6 +1207,13 @@ static enum action asm_line(struct inctx *inp)
 			fwrite(objcode.str, objcode.used, 1, obj_fp);
 		objcode.used = 0;
 	}
+	if (codefile) {
+		org += code_slice.size;
+		if (passno && obj_fp && !in_dsect)
+			codefile_write(obj_fp);
+		codefile_close();
+		codefile = false;
+	}
 	return act;
 }
 
@@ -653,54 +1221,35 @@ enum action asm_file(struct inctx *inp)
 {
 	enum action act = ACT_CONTINUE;
 	inp->lineno = 1;
-	inp->next_line = 2;
+	inp->next_line = 1;
 	inp->line.used = 0;
-	inp->wcond.used = 0;
+	inp->line.allocated = 0;
+	inp->wcond = NULL;
 	inp->rpt_line = 0;
 	inp->wend_skipping = false;
-	/* Read the first line one character at a time to detect the
-	 * line ending in use.
-	 */
-	int ch = getc(inp->fp);
-	if (ch != EOF) {
-		fpos_t fcopy;
-		do {
-			if (ch == '\r' || ch == '\n') {
-				dstr_add_ch(&inp->line, '\n');
-				break;
-			}
-			dstr_add_ch(&inp->line, ch);
-			ch = getc(inp->fp);
-		} while (ch != EOF);
-
-		inp->lineptr = inp->line.str;
+	inp->fline = 0;
+	while (act != ACT_STOP) {
+		struct srcfile *sf = inp->src;
+		unsigned lno = inp->fline++;
+		if (lno >= sf->nlines)
+			break;
+		inp->line.str = inp->lineptr = sf->data + sf->lines[lno];
+		inp->line.used = sf->lines[lno+1] - sf->lines[lno];
+		inp->ir = sf->ir + lno;
+		inp->flags = sf->flags[lno];
+		inp->lineno = inp->next_line++;
 		act = asm_line(inp);
-		if (ch != EOF) {
-			/* Switch to line at a time with new delimiter */
-			while (act != ACT_STOP) {
-				switch(act) {
-					case ACT_RMARK:
-						printf("pass %d: file: marking\n", passno);
-						fgetpos(inp->fp, &inp->fposn);
-						fcopy = inp->fposn;
-						break;
-					case ACT_RBACK:
-						printf("pass %d: back-tracking, %d\n", passno, memcmp(&fcopy, &inp->fposn, sizeof(fcopy)));
-						fsetpos(inp->fp, &fcopy);
-						inp->lineno = inp->rpt_line;
-						break;
-					default:
-						break;
-				}
-				if (dstr_getdelim(&inp->line, ch, inp->fp) < 0)
-					break;
-				inp->lineno = inp->next_line++;
-				inp->lineptr = inp->line.str;
-				act = asm_line(inp);
-			}
+		if (inp->src != sf)
+			continue; /* a CHN has replaced the file */
+		if (act == ACT_RMARK)
+			inp->fmark = inp->fline;
+		else if (act == ACT_RBACK) {
+			inp->fline = inp->fmark;
+			inp->lineno = inp->rpt_line;
 		}
 	}
-	fclose(inp->fp);
+	inp->src = NULL;
+	inp->ir = NULL;
 	return act;
 }
 
@@ -717,21 +1266,76 @@ static void asm_pass(int argc, char **argv, struct inctx *inp)
     cond_level = 0;
     mac_count = 0;
     scope_no = SCOPE_LOCAL;
+    drift_count = 0;
+    pass_count++;
+    sym_pass++;
+    arena_free(&pass_arena);
 
     for (int argno = optind; argno < argc; argno++) {
 		const char *fn = argv[argno];
 		inp->name = fn;
-		if ((inp->fp = fopen(fn, "r")))
+		if ((inp->src = srcfile_open(fn)))
 			asm_file(inp);
 		else {
 			fprintf(stderr, openerr, "source", fn, strerror(errno));
 			err_count++;
 		}
 	}
-	if (cond_level) {
-		fprintf(stderr, "laxasm: %u level(s) of IF still in-force (missing FI) at end of pass %u\n", cond_level, passno+1);
+	if (cond_level && !err_quiet) {
+		fprintf(stderr, "laxasm: %u level(s) of IF still in-force (missing FI) at end of pass %u\n", cond_level, pass_count);
 		err_count++;
 	}
+	if (drift_count && verbose)
+		fprintf(stderr, "laxasm: pass %u: %u label(s) moved, first %s from &%04X to &%04X\n",
+		        pass_count, drift_count, drift_sym->name, drift_from, drift_to);
+}
+
+#define MAX_PASSES 10
+
+/*
+ * Labels moved during the output pass so size the program again until
+ * they stop moving then start the output afresh.  Each sizing pass is
+ * a whole pass: a drifting label can change the size of an instruction
+ * anywhere before or after it so there is no safe point to start from.
+ * Should they still be moving after MAX_PASSES the object file, which
+ * holds code from an unsettled pass, is removed.
+ */
+
+static bool asm_redo(int argc, char **argv, struct inctx *inp)
+{
+	passno = 0;
+	do {
+		if (pass_count >= MAX_PASSES) {
+			err_quiet = false;
+			fprintf(stderr, "laxasm: label addresses still changing after %u passes\n", pass_count);
+			err_count++;
+			if (obj_fp) {
+				fclose(obj_fp);
+				obj_fp = NULL;
+				remove(obj_filename);
+			}
+			return false;
+		}
+		asm_pass(argc, argv, inp);
+	} while (drift_count);
+	err_quiet = false;
+	drift_redo = false;
+	drift_final = true;
+	if (obj_fp && !freopen(obj_filename, "wb", obj_fp)) {
+		fprintf(stderr, openerr, "object code", obj_filename, strerror(errno));
+		err_count++;
+		return false;
+	}
+	if (list_fp && !freopen(list_filename, "w", list_fp)) {
+		fprintf(stderr, openerr, "listing", list_filename, strerror(errno));
+		err_count++;
+		return false;
+	}
+	cur_page = 0;
+	cur_line = 0;
+	passno = 1;
+	asm_pass(argc, argv, inp);
+	return true;
 }
 
 static const char hst_chars[] = "#$%&.?@^";
@@ -740,18 +1344,35 @@ static const char bbc_chars[] = "?<;+/#=>";
 int main(int argc, char **argv)
 {
     int opt, status = 0;
-    while ((opt = getopt(argc, argv, "adl:o:p:rw:ACFLMPST")) != -1) {
+    while ((opt = getopt(argc, argv, "1adjl:m:o:p:rvw:ACFLMPST")) != -1) {
         switch(opt) {
+            case '1':
+                one_pass = true;
+                break;
             case 'a':
-                symbol_cmp = symbol_cmp_ade;
+                symbol_sig = 6;
                 break;
             case 'd':
 				swift_sym = true;
 				break;
+            case 'j':
+				prefetch = true;
+				break;
             case 'l':
                 list_filename = optarg;
                 list_opts |= LISTO_ENABLED;
                 break;
+            case 'm': {
+				char *end;
+				long depth = strtol(optarg, &end, 10);
+				if (*end || depth < 1 || depth > MAX_DEPTH) {
+					fprintf(stderr, "laxasm: -m depth must be from 1 to %u\n", MAX_DEPTH);
+					status = 1;
+				}
+				else
+					max_depth = depth;
+				break;
+			}
             case 'o':
                 obj_filename = optarg;
                 break;
@@ -761,6 +1382,9 @@ int main(int argc, char **argv)
             case 'r':
                 no_cmos = true;
                 break;
+            case 'v':
+				verbose = true;
+				break;
             case 'w':
 				page_width = atoi(optarg);
 				break;
@@ -796,8 +1420,8 @@ int main(int argc, char **argv)
 		struct inctx infile;
 		infile.parent = NULL;
 		infile.whence = ' ';
-		dstr_empty(&infile.line, MIN_LINE);
-		dstr_empty(&infile.wcond, 0);
+		dstr_empty(&infile.line, 0);
+		infile.wcond = NULL;
 		dstr_empty(&objcode, MIN_LINE);
 		if (list_filename && (list_fp = fopen(list_filename, "w")) == NULL) {
 			fprintf(stderr, openerr, "listing", list_filename, strerror(errno));
@@ -810,18 +1434,31 @@ int main(int argc, char **argv)
 			}
 			else {
 				memcpy(tab_stops, default_tabs, sizeof(tab_stops));
+				opword_build();
+				if (prefetch)
+					srcfile_prefetch(argc - optind, argv + optind);
 				symbol_enter = symbol_enter_pass1;
-				asm_pass(argc, argv, &infile);
-				if (err_count) {
-					fprintf(stderr, "laxasm: %u errors, on pass 1, pass 2 skipped\n", err_count);
-					status = 4;
+				pass_defines = true;
+				if (!one_pass) {
+					asm_pass(argc, argv, &infile);
+					if (err_count) {
+						fprintf(stderr, "laxasm: %u errors, on pass 1, pass 2 skipped\n", err_count);
+						status = 4;
+					}
+					pass_defines = false;
+					symbol_enter = symbol_enter_pass2;
+					symbol_freeze();
 				}
-				else {
+				if (status == 0) {
+					/* with one pass symbols are defined as code is planted */
 					passno = 1;
-					symbol_enter = symbol_enter_pass2;
 					asm_pass(argc, argv, &infile);
+					if (!drift_redo || asm_redo(argc, argv, &infile)) {
+						fixup_resolve();
+						symbol_resolve_all();
+					}
 					if (err_count) {
-						fprintf(stderr, "laxasm: %u errors, on pass 2\n", err_count);
+						fprintf(stderr, "laxasm: %u errors, on pass %u\n", err_count, pass_count);
 						status = 5;
 					}
 					if (list_fp && !(list_opts & LISTO_SYMTAB))
@@ -832,6 +1469,15 @@ int main(int argc, char **argv)
 			}
 			if (obj_fp)
 				fclose(obj_fp);
+			if (verbose) {
+				fprintf(stderr, "laxasm: macro expansions: %lu misses, %lu hits\n", mac_misses, mac_hits);
+				arena_stats(&run_arena);
+				arena_stats(&pass_arena);
+			}
+			arena_free(&pass_arena);
+			arena_free(&run_arena);
+			asm_free_frames();
+			free(cond_stack);
 		}
 		if (list_fp)
 			fclose(list_fp);
@@ -863,6 +1509,6 @@ int main(int argc, char **argv)
 		}
 	}
     else
-        fputs("Usage: laxasm [ -a ] [ -c level ] [ -f list-file ] [ -l level ] [ -o obj-file ] [ -r ] [ -s ] <file> [ ... ]\n", stderr);
+        fputs("Usage: laxasm [ -1 ] [ -a ] [ -j ] [ -c level ] [ -f list-file ] [ -l level ] [ -m depth ] [ -o obj-file ] [ -r ] [ -s ] [ -v ] <file> [ ... ]\n", stderr);
     return status;
 }
@@ -21,21 +21,153 @@
 #define LISTO_SKIPPED  0x080
 #define LISTO_ENABLED  0x100
 
-struct macline {
-	struct macline *next;
+/* What a line contains, to save searching it. */
+
+#define LINE_TAB 0x01
+#define LINE_AT  0x02
+#define LINE_ANY (LINE_TAB|LINE_AT)
+
+/* What was found in the opcode field of a line, kept in its lineir. */
+
+enum opkind {
+	OP_UNSEEN,
+	OP_NONE,
+	OP_MACRO,
+	OP_ASSIGN,
+	OP_IF,
+	OP_IFDEF,
+	OP_IFNDEF,
+	OP_ELSE,
+	OP_FI,
+	OP_WEND,
+	OP_INCLUDE,
+	OP_M6502,
+	OP_PSEUDO,
+	OP_MACCALL,
+	OP_OTHER
+};
+
+struct optab_ent;
+struct op_type;
+struct exprcode;
+
+/* A symbol found at a given position in a line, kept in its lineir. */
+
+struct symref {
+	struct symbol *sym;
+	unsigned scope;
+	uint16_t posn;
+	uint16_t len;
+};
+
+#define MAX_SYMREFS 8
+
+/*
+ * What is learned about a line from a file or a macro body the first
+ * time it is assembled: what its opcode field resolved to, the symbols
+ * it refers to and its compiled expressions.  When the same line is
+ * assembled again, on pass 2, by a loop or by another expansion of the
+ * macro, none of these need be scanned, looked up or parsed again.
+ */
+
+struct lineir {
+	uint8_t kind;
+	uint8_t nrefs;
+	uint16_t label_size;
+	uint16_t opstart;
+	uint16_t opsize;
+	union {
+		const struct optab_ent *opc;
+		const struct op_type *pseudo;
+		struct symbol *macro;
+	};
+	struct symref *refs;
+	struct exprcode *exprs;
+};
+
+/*
+ * A macro body line is compiled when the macro is defined into a list
+ * of segments, spans of literal text and the arguments or other values
+ * substituted for each '@', so that expanding it is just joining them.
+ * A substitution that needs expressions evaluating, @(start,len) and
+ * @[expr], ends the list with a segment that has the rest of the line
+ * substituted as it is expanded.
+ */
+
+enum segkind {
+	SEG_TEXT,
+	SEG_ARG,
+	SEG_MACNO,
+	SEG_NARG,
+	SEG_REST
+};
+
+#define SEG_LEN 0x80    /* substitute the length instead */
+
+struct macseg {
+	uint8_t kind;
+	uint8_t argno;
+	uint32_t start;
+	uint32_t len;
+};
+
+/*
+ * Identical lines, within one macro or across several, share one body
+ * so they are compiled and classified only once.
+ */
+
+struct macbody {
+	struct macbody *hnext;
+	struct lineir ir;
+	struct macseg *segs;
+	unsigned nsegs;
+	uint8_t flags;
+	bool argsonly;          /* substituted text depends only on the arguments */
 	size_t length;
 	char text[1];
 };
 
+struct macline {
+	struct macline *next;
+	struct macbody *body;
+	unsigned index;
+};
+
+struct srcfile {
+	char *data;
+	size_t size;
+	size_t mapped;
+	uint32_t *lines;
+	uint8_t *flags;
+	struct lineir *ir;
+	unsigned nlines;
+	const char *guard;
+};
+
+struct codeslice {
+	const uint8_t *bytes;
+	size_t offset;
+	size_t size;
+	void *map;
+#ifdef __WIN32__
+	FILE *fp;
+#else
+	int fd;
+	size_t maplen;
+#endif
+};
+
 struct inctx {
 	struct dstring line;
-	struct dstring wcond;
+	struct exprcode *wcond;
 	union {
-		fpos_t fposn;
+		unsigned fmark;
 		struct macline *mpos;
 	};
 	struct inctx *parent;
-	FILE *fp;
+	struct srcfile *src;
+	struct lineir *ir;
+	unsigned fline;
 	const char *name;
 	char *lineptr;
 	unsigned lineno;
@@ -43,6 +175,14 @@ struct inctx {
 	unsigned next_line;
 	char whence;
 	char wend_skipping;
+	uint8_t flags;
+};
+
+enum fixkind {
+	FIX_BYTE,
+	FIX_WORD,
+	FIX_DBYTE,
+	FIX_REL
 };
 
 enum action {
@@ -53,10 +193,26 @@ enum action {
 	ACT_STOP
 };
 
+struct arena_block;
+
+struct arena {
+	const char *name;
+	struct arena_block *blocks;
+	char *next;
+	size_t left;
+	unsigned long allocs;
+	size_t bytes;
+	unsigned nblocks;
+	unsigned max_blocks;
+};
+
 #define SCOPE_MACRO  0
 #define SCOPE_GLOBAL 1
 #define SCOPE_LOCAL  2
 
+struct symdef;
+struct symuse;
+
 struct symbol {
 	int  scope;
 	char *name;
@@ -64,7 +220,11 @@ struct symbol {
 		uint16_t value;
 		struct macline *macro;
 	};
+	struct symdef *def;     /* EQU awaiting evaluation */
+	struct symuse *users;   /* deferred EQUs that used this symbol */
+	unsigned defpass;       /* sym_pass when last defined */
 	char used;
+	char assigned;          /* given a value by = */
 	char name_str[1];
 };
 
@@ -75,38 +235,76 @@ extern unsigned list_opts, passno, scope_no;
 extern unsigned page_len, page_width, cur_page, cur_line, tab_stops[MAX_TAB_STOPS];
 extern const unsigned default_tabs[MAX_TAB_STOPS];
 extern uint16_t org, org_code, org_dsect, list_value, load_addr, exec_addr, addr_msw;
-extern bool no_cmos, in_dsect, in_ds, codefile, cond_skipping;
+extern bool no_cmos, in_dsect, in_ds, codefile, cond_skipping, pass_defines;
 extern struct dstring objcode, title;
+extern struct codeslice code_slice;
 extern struct symbol *macsym;
 
 __attribute__((format (printf, 2, 3)))
 extern void asm_error(struct inctx *inp, const char *fmt, ...);
+extern void asm_opword(const char *name, enum opkind kind, const void *ptr);
+extern void asm_drift(struct inctx *inp, struct symbol *sym, uint16_t value);
 extern void list_line(struct inctx *inp);
 extern enum action asm_file(struct inctx *inp);
+extern struct inctx *asm_nest_file(struct inctx *inp);
+extern void asm_unnest(void);
 extern int non_space(struct inctx *inp);
 extern void dump_ictx(struct inctx *inp, const char *when);
 
+/* arena.c */
+extern struct arena run_arena, pass_arena;
+extern void *arena_alloc(struct arena *a, size_t size);
+extern char *arena_strndup(struct arena *a, const char *src, size_t len);
+extern void arena_free(struct arena *a);
+extern void arena_stats(const struct arena *a);
+
 /* symbols.c */
-extern void *symbols;
-extern int (*symbol_cmp)(const void *, const void *);
-extern int symbol_cmp_ade(const void *a, const void *b);
+extern unsigned symbol_sig, sym_pass;
 extern int symbol_parse(struct inctx *inp);
+extern void symbol_uppercase(const char *src, size_t label_size, char *dest);
+extern const char *symbol_errname(const char *src, size_t len);
 extern struct symbol *(*symbol_enter)(struct inctx *inp, size_t label_size, int scope, bool replace);
 extern struct symbol *symbol_enter_pass1(struct inctx *inp, size_t label_size, int scope, bool replace);
 extern struct symbol *symbol_enter_pass2(struct inctx *inp, size_t label_size, int scope, bool replace);
 extern struct symbol *symbol_lookup(struct inctx *inp, bool no_undef);
-//extern struct symbol *symbol_macfind(char *opname);
+extern bool symbol_defined(struct inctx *inp);
+extern struct symbol *symbol_macfind(const char *opname, size_t len);
+extern void symbol_freeze(void);
+extern void symbol_set(struct symbol *sym, uint16_t value);
+extern uint16_t symbol_equ(struct inctx *inp, struct symbol *sym);
+extern bool symbol_ready(struct symbol *sym, bool no_undef);
+extern void symbol_resolve_all(void);
 extern void symbol_print(void);
 extern void symbol_swift(void);
 
+/* srcfile.c */
+extern void srcfile_prefetch(int argc, char **argv);
+extern struct srcfile *srcfile_open(const char *name);
+extern long codefile_open(const char *name);
+extern bool codefile_slice(size_t offset, size_t size);
+extern void codefile_write(FILE *fp);
+extern void codefile_close(void);
+
 /* expression.c */
+extern bool expr_forward;
 extern int expression(struct inctx *inp, bool no_undef);
+extern bool expr_literal(struct inctx *inp, unsigned *value);
+extern int expr_keep(struct inctx *inp, bool no_undef, struct exprcode **kept);
+extern int expr_again(struct inctx *inp, struct exprcode *ec, bool no_undef);
+
+/* fixup.c */
+extern bool one_pass;
+extern void fixup_add(struct inctx *inp, const char *expr, size_t offset, size_t count, enum fixkind kind);
+extern void fixup_resolve(void);
 
 /* m6502.c */
-extern bool m6502_op(struct inctx *inp, const char *opname);
+extern void m6502_opwords(void);
+extern void m6502_op(struct inctx *inp, const struct optab_ent *opc);
 
 /* pseudo.c */
-extern enum action pseudo_op(struct inctx *inp, const char *opname, size_t opsize, struct symbol *sym);
+extern void pseudo_opwords(void);
+extern bool pseudo_sets_label(const struct op_type *op);
+extern enum action pseudo_op(struct inctx *inp, const struct op_type *op, struct symbol *sym);
 extern enum action pseudo_include(struct inctx *inp);
 
 #endif
@@ -108,229 +108,319 @@ static const struct optab_ent m6502_optab[] = {
 };
 
 /*
- * Addressing mode tables.
+ * Addressing modes.  Where an operand may be in zero page or need two
+ * bytes both modes are here and the shorter is used when it exists for
+ * the instruction and the value fits.
+ */
+
+enum m6502_mode {
+	AM_NONE = -1,
+	AM_IMP,
+	AM_ACC,
+	AM_IMM,
+	AM_ZP,
+	AM_ZPX,
+	AM_ZPY,
+	AM_ABS,
+	AM_ABSX,
+	AM_ABSY,
+	AM_INDX,
+	AM_INDY,
+	AM_IND,
+	AM_REL,
+	AM_COUNT
+};
+
+static const char *const m6502_mode_names[AM_COUNT] = {
+	"implied", "accumulator", "immediate", "absolute", "indexed X",
+	"indexed Y", "absolute", "indexed X", "indexed Y", "indexed indirect",
+	"indirect indexed", "(non-indexed) indrect", "relative"
+};
+
+/*
+ * Addressing mode table.
  *
- * Not all addressing modes are represented in these tables but where
- * many groups of instructions all support the same addressing mode the
- * table here gives a value to be added to the 'base' value from the
- * opcode table above to get the final opcode value.  The value 0xff
- * means this mode is not available on that instruction group and
- * bit 7 set means that combination is CMOS-only.
+ * For each instruction group and addressing mode this gives a value to
+ * be added to the 'base' value from the opcode table above to get the
+ * final opcode, the length of the instruction and whether that mode is
+ * CMOS-only.  L1 to L3 give the length, C1 to C3 the same for CMOS-only
+ * modes, and __ means the mode is not available on that group.
+ * Encodings which are not the base plus a value for the group are in
+ * the exceptions table that follows.
+ */
+
+#define __      0x000
+#define L1(d)   (0x100|(d))
+#define L2(d)   (0x200|(d))
+#define L3(d)   (0x300|(d))
+#define CMOS    0x080
+#define C1(d)   (L1(d)|CMOS)
+#define C2(d)   (L2(d)|CMOS)
+#define C3(d)   (L3(d)|CMOS)
+
+static const uint16_t m6502_modes[16][AM_COUNT] = {
+/*            IMP       ACC       IMM       ZP        ZPX       ZPY       ABS       ABSX      ABSY      INDX      INDY      IND       REL */
+/* IMP   */ { L1(0x00), __,       __,       __,       __,       __,       __,       __,       __,       __,       __,       __,       __ },
+/* REL   */ { __,       __,       __,       __,       __,       __,       __,       __,       __,       __,       __,       __,       L2(0x00) },
+/* ALU   */ { __,       __,       L2(0x09), L2(0x05), L2(0x15), __,       L3(0x0d), L3(0x1d), L3(0x19), L2(0x01), L2(0x11), C2(0x12), __ },
+/* STA   */ { __,       __,       __,       L2(0x05), L2(0x15), __,       L3(0x0d), L3(0x1d), L3(0x19), L2(0x01), L2(0x11), C2(0x12), __ },
+/* shift */ { L1(0x0a), L1(0x0a), __,       L2(0x06), L2(0x16), __,       L3(0x0e), L3(0x1e), __,       __,       __,       __,       __ },
+/* I/D   */ { __,       __,       __,       L2(0x06), L2(0x16), __,       L3(0x0e), L3(0x1e), __,       __,       __,       __,       __ },
+/* BIT   */ { __,       __,       C2(0x69), L2(0x04), C2(0x14), __,       L3(0x0c), C3(0x1c), __,       __,       __,       __,       __ },
+/* CPX/Y */ { __,       __,       L2(0x00), L2(0x04), __,       __,       L3(0x0c), __,       __,       __,       __,       __,       __ },
+/* LDX   */ { __,       __,       L2(0x02), L2(0x06), __,       L2(0x16), L3(0x0e), __,       L3(0x1e), __,       __,       __,       __ },
+/* LDY   */ { __,       __,       L2(0x00), L2(0x04), L2(0x14), __,       L3(0x0c), L3(0x1c), __,       __,       __,       __,       __ },
+/* STX   */ { __,       __,       __,       L2(0x06), __,       L2(0x16), L3(0x0e), __,       __,       __,       __,       __,       __ },
+/* STY   */ { __,       __,       __,       L2(0x04), L2(0x14), __,       L3(0x0c), __,       __,       __,       __,       __,       __ },
+/* JMP   */ { __,       __,       __,       __,       __,       __,       L3(0x0c), __,       __,       C3(0x3c), __,       L3(0x2c), __ },
+/* JSR   */ { __,       __,       __,       __,       __,       __,       L3(0x00), __,       __,       __,       __,       __,       __ },
+/* STZ   */ { __,       __,       __,       L2(0x04), L2(0x14), __,       L3(0x3c), L3(0x3e), __,       __,       __,       __,       __ },
+/* TSB   */ { __,       __,       __,       L2(0x04), __,       __,       L3(0x0c), __,       __,       __,       __,       __,       __ }
+};
+
+static const struct {
+	char mnemonic[4];
+	uint8_t mode;
+	uint8_t code;
+	uint16_t info;
+} m6502_except[] = {
+	{ "DEC", AM_ACC, 0x3a, C1(0) },
+	{ "INC", AM_ACC, 0x1a, C1(0) }
+};
+
+/*
+ * The final opcode and length, and whether it is CMOS-only, for each
+ * mnemonic in each addressing mode, expanded from the tables above as
+ * the assembler starts.  A length of zero means that mode is not valid.
  */
 
-/*                                    IMP   REL   ALU   STA   shift I/D   BIT   CPX/Y LDX   LDY   STX   STY   JMP   JSR   STZ   TSB */
-static const uint8_t m6502_imm[]  = { 0xff, 0xff, 0x09, 0xff, 0xff, 0xff, 0x69, 0x00, 0x02, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
-static const uint8_t m6502_zp[]   = { 0xff, 0xff, 0x05, 0x05, 0x06, 0x06, 0x04, 0x04, 0x06, 0x04, 0x06, 0x04, 0xff, 0xff, 0x04, 0x04 };
-static const uint8_t m6502_zpx[]  = { 0xff, 0xff, 0x15, 0x15, 0x16, 0x16, 0x94, 0xff, 0xff, 0x14, 0xff, 0x14, 0xff, 0xff, 0x14, 0xff };
-static const uint8_t m6502_zpy[]  = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x16, 0xff, 0x16, 0xff, 0xff, 0xff, 0xff, 0xff };
-static const uint8_t m6502_abs[]  = { 0xff, 0xff, 0x0d, 0x0d, 0x0e, 0x0e, 0x0c, 0x0c, 0x0e, 0x0c, 0x0e, 0x0c, 0x0c, 0x00, 0x3c, 0x0c };
-static const uint8_t m6502_absx[] = { 0xff, 0xff, 0x1d, 0x1d, 0x1e, 0x1e, 0x9c, 0xff, 0xff, 0x1c, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff };
-static const uint8_t m6502_absy[] = { 0xff, 0xff, 0x19, 0x19, 0xff, 0xff, 0xff, 0xff, 0x1e, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+struct m6502_enc {
+	uint8_t code;
+	uint8_t info;
+};
+
+#define ENC_LEN  0x03
+#define ENC_CMOS 0x80
+
+#define NUM_OPS (sizeof(m6502_optab) / sizeof(m6502_optab[0]))
+
+static struct m6502_enc m6502_matrix[NUM_OPS][AM_COUNT];
 
 static const char cmos_only_in[] = "%s is a CMOS-only instruction";
 static const char cmos_only_am[] = "%s addressing on %s is CMOS-only";
 static const char invalid_am[]   = "%s addressing is not valid for %s";
 static const char rel_range[]    = "%s branch of %d bytes is out of range by %d bytes";
+static const char fwd_zponly[]   = "forward reference cannot use zero page only %s addressing on %s";
+
+/*
+ * In single-pass mode an operand that refers forward is planted as
+ * zero, always in the absolute form of the instruction when there is
+ * a choice, and patched once the symbol is defined.
+ */
+
+static void m6502_forward(struct inctx *inp, const char *expr, enum fixkind kind)
+{
+	if (objcode.used > 1) {
+		objcode.str[1] = 0;
+		if (objcode.used > 2)
+			objcode.str[2] = 0;
+		fixup_add(inp, expr, 1, 1, kind);
+	}
+}
+
+/* On pass 1 only the length of the instruction is needed. */
 
 static void m6502_one_byte(unsigned code)
 {
-	objcode.str[0] = code;
+	if (passno)
+		objcode.str[0] = code;
 	objcode.used = 1;
 }
 
 static void m6502_two_byte(unsigned code, unsigned value)
 {
-	objcode.str[0] = code;
-	objcode.str[1] = value;
+	if (passno) {
+		objcode.str[0] = code;
+		objcode.str[1] = value;
+	}
 	objcode.used = 2;
 }
 
 static void m6502_three_byte(unsigned code, unsigned value)
 {
-	objcode.str[0] = code;
-	objcode.str[1] = value;
-	objcode.str[2] = value >> 8;
+	if (passno) {
+		objcode.str[0] = code;
+		objcode.str[1] = value;
+		objcode.str[2] = value >> 8;
+	}
 	objcode.used = 3;
 }
 
-static void m6502_implied(struct inctx *inp, const struct optab_ent *opc)
+static void m6502_cmos_error(struct inctx *inp, const struct optab_ent *opc, enum m6502_mode mode)
 {
-	unsigned group = opc->group & 0x7f;
-	if (group == 0)
-		m6502_one_byte(opc->base);
-	else if (group == 0x04)
-		m6502_one_byte(opc->base + 0x0a);
+	if (mode == AM_ACC)
+		asm_error(inp, "%s A is a CMOS-only instruction", opc->mnemonic);
+	else if (mode == AM_IND)
+		asm_error(inp, "(non-indexed) indrect addressing mode is CMOS-only");
 	else
-		asm_error(inp, "%s needs an operand", opc->mnemonic);
+		asm_error(inp, cmos_only_am, m6502_mode_names[mode], opc->mnemonic);
 }
 
-static void m6502_accumulator(struct inctx *inp, const struct optab_ent *opc)
+/*
+ * Plant an instruction given its addressing mode.  For the absolute
+ * modes the zero page form is used instead where there is one and the
+ * value fits, unless the value is not yet known.
+ */
+
+static void m6502_encode(struct inctx *inp, const struct optab_ent *opc, enum m6502_mode mode, unsigned value, bool forward)
 {
-	unsigned group = opc->group;
-	if (group == 0x04)
-		m6502_one_byte(opc->base + 0x0a);
-	else if (group == 0x05) {
-		if (no_cmos)
-			asm_error(inp, "%s A is a CMOS-only instruction", opc->mnemonic);
+	const struct m6502_enc *row = m6502_matrix[opc - m6502_optab];
+	const struct m6502_enc *enc = row + mode;
+	if (mode == AM_ABS && row[AM_REL].info) {
+		int offs = (int)value - (int)(org + 2);
+		if (!forward && offs < -128)
+			asm_error(inp, rel_range, "backward", -offs, -offs - 128);
+		else if (!forward && offs > 127)
+			asm_error(inp, rel_range, "forward", offs, offs - 127);
+		m6502_two_byte(row[AM_REL].code, offs);
+		return;
+	}
+	if (mode >= AM_ABS && mode <= AM_ABSY) {
+		const struct m6502_enc *zp = enc - (AM_ABS - AM_ZP);
+		if (zp->info && value < 0x100 && !forward)
+			enc = zp;
+		else if (!enc->info) {
+			if (forward && zp->info)
+				asm_error(inp, fwd_zponly, m6502_mode_names[mode], opc->mnemonic);
+			else
+				asm_error(inp, invalid_am, m6502_mode_names[mode], opc->mnemonic);
+			return;
+		}
+	}
+	if (!enc->info) {
+		if (mode == AM_IMP)
+			asm_error(inp, "%s needs an operand", opc->mnemonic);
 		else
-			m6502_one_byte(0xe0 - opc->base + 0x1a);
+			asm_error(inp, invalid_am, m6502_mode_names[mode], opc->mnemonic);
 	}
+	else if ((enc->info & ENC_CMOS) && no_cmos)
+		m6502_cmos_error(inp, opc, enc - row);
+	else if ((enc->info & ENC_LEN) == 1)
+		m6502_one_byte(enc->code);
+	else if ((enc->info & ENC_LEN) == 2)
+		m6502_two_byte(enc->code, value);
 	else
-		asm_error(inp, invalid_am, "accumulator", opc->mnemonic);
+		m6502_three_byte(enc->code, value);
 }
 
-static void m6502_immediate(struct inctx *inp, const struct optab_ent *opc)
-{
-	unsigned delta = m6502_imm[opc->group & 0x7f];
-	if (delta != 0xff) {
-		++inp->lineptr;
-		m6502_two_byte(opc->base + delta, expression(inp, false));
-	}
-	else
-		asm_error(inp, invalid_am, "immediate", opc->mnemonic);
-}
+#include "charclass.h"
 
-static void m6502_auto_pick(struct inctx *inp, const struct optab_ent *opc, const uint8_t *grp8, const uint8_t *grp16, unsigned value, const char *mode)
-{
-	unsigned group = opc->group & 0x7f;
-	unsigned delta = grp8[group];
-	if (delta != 0xff && value < 0x100)
-		m6502_two_byte(opc->base + (delta & 0x7f), value);
-	else {
-		delta = grp16[group];
-		if (delta == 0xff)
-			asm_error(inp, invalid_am, mode, opc->mnemonic);
-		else if ((delta & 0x80) && no_cmos)
-			asm_error(inp, cmos_only_am, mode, opc->mnemonic);
-		else
-			m6502_three_byte(opc->base + (delta & 0x7f), value);
-	}
-}
+/*
+ * Work out the addressing mode from the syntax of the operand,
+ * evaluating any expression in it.  An immediate operand to an
+ * instruction that has no immediate mode is not evaluated so the
+ * error is reported at the '#'.
+ */
 
-static void m6502_indirect(struct inctx *inp, const struct optab_ent *opc)
+static enum m6502_mode m6502_mode(struct inctx *inp, const struct m6502_enc *row, uint16_t *value, const char **expr)
 {
-	++inp->lineptr;
-	uint16_t value = expression(inp, passno);
-	int ch = *inp->lineptr;
-	if (ch == ',') {
-		/* should be indexed (by X) indirect. */
-		++inp->lineptr;
-		ch = non_space(inp);
-		if (ch == 'X' || ch == 'x') {
-			++inp->lineptr;
-			if (non_space(inp) == ')') {
-				unsigned group = opc->group & 0x7f;
-				if (group == 0x02 || group == 0x03)
-					m6502_two_byte(opc->base + 0x01, value);
-				else if (group == 0x0c) {
-					if (no_cmos)
-						asm_error(inp, cmos_only_am, "indexed indirect", opc->mnemonic);
-					else
-						m6502_three_byte(0x7c, value);
-				}
-				else
-					asm_error(inp, invalid_am, "indexed indirect", opc->mnemonic);
-			}
-			else
-				asm_error(inp, "missing closing bracket ')'");
-		}
-		else
-			asm_error(inp, "only X is used for indexed indirect addressing mode");
+	int ch = non_space(inp);
+	if (asm_isendchar(ch))
+		return AM_IMP;
+	if (ch == '#') {
+		if (!row[AM_IMM].info)
+			return AM_IMM;
+		*expr = ++inp->lineptr;
+		*value = expression(inp, !pass_defines);
+		return AM_IMM;
 	}
-	else if (ch == ')') {
-		/* is it indirect indexed (by Y)? */
-		++inp->lineptr;
-		if (non_space(inp) == ',') {
+	if ((ch == 'A' || ch == 'a') && asm_isdelim(inp->lineptr[1]))
+		return AM_ACC;
+	if (ch == '(') {
+		*expr = ++inp->lineptr;
+		*value = expression(inp, !pass_defines);
+		ch = *inp->lineptr;
+		if (ch == ',') {
+			/* should be indexed (by X) indirect. */
 			++inp->lineptr;
 			ch = non_space(inp);
-			if (ch == 'Y' || ch == 'y') {
-				unsigned group = opc->group & 0x7f;
-				if (group == 0x02 || group == 0x03)
-					m6502_two_byte(opc->base + 0x11, value);
-				else
-					asm_error(inp, invalid_am, "indirect indexed", opc->mnemonic);
+			if (ch != 'X' && ch != 'x')
+				asm_error(inp, "only X is used for indexed indirect addressing mode");
+			else {
+				++inp->lineptr;
+				if (non_space(inp) == ')')
+					return AM_INDX;
+				asm_error(inp, "missing closing bracket ')'");
 			}
-			else
-				asm_error(inp, "only Y is used for indirect indexed addressing mode");
 		}
-		else {
-			unsigned group = opc->group & 0x7f;
-			if (group == 0x02 || group == 0x03) {
-				if (no_cmos)
-					asm_error(inp, "(non-indexed) indrect addressing mode is CMOS-only");
-				else
-					m6502_two_byte(opc->base + 0x12, value);
-			}
-			else if (group == 0x0c)
-				m6502_three_byte(opc->base + 0x2c, value);
-			else
-				asm_error(inp, invalid_am, "(non-indexed) indrect", opc->mnemonic);
+		else if (ch == ')') {
+			/* is it indirect indexed (by Y)? */
+			++inp->lineptr;
+			if (non_space(inp) != ',')
+				return AM_IND;
+			++inp->lineptr;
+			ch = non_space(inp);
+			if (ch == 'Y' || ch == 'y')
+				return AM_INDY;
+			asm_error(inp, "only Y is used for indirect indexed addressing mode");
 		}
+		else
+			asm_error(inp, "syntax error");
+		return AM_NONE;
 	}
-	else
-		asm_error(inp, "syntax error");
+	*expr = inp->lineptr;
+	*value = expression(inp, !pass_defines);
+	if (*inp->lineptr != ',')
+		return AM_ABS;
+	/* indexed addressing */
+	++inp->lineptr;
+	ch = non_space(inp);
+	if (ch == 'X' || ch == 'x')
+		return AM_ABSX;
+	if (ch == 'Y' || ch == 'y')
+		return AM_ABSY;
+	asm_error(inp, "invalid register for indexed addressing");
+	return AM_NONE;
 }
 
-static void m6502_others(struct inctx *inp, const struct optab_ent *opc)
+void m6502_opwords(void)
 {
-	uint16_t value = expression(inp, passno);
-	int ch = *inp->lineptr;
-	if (ch == ',') {
-		/* indexed addressing */
-		++inp->lineptr;
-		ch = non_space(inp);
-		if (ch == 'X' || ch == 'x')
-			m6502_auto_pick(inp, opc, m6502_zpx, m6502_absx, value, "indexed X");
-		else if (ch == 'Y' || ch == 'y')
-			m6502_auto_pick(inp, opc, m6502_zpy, m6502_absy, value, "indexed Y");
- 		else
-			asm_error(inp, "invalid register for indexed addressing");
-	}
-	else {
-		if ((opc->group & 0x7f) == 0x01) {
-			int offs = (int)value - (int)(org + 2);
-			if (offs < -128)
-				asm_error(inp, rel_range, "backward", -offs, -offs - 128);
-			else if (offs > 127)
-				asm_error(inp, rel_range, "forward", offs, offs - 127);
-			m6502_two_byte(opc->base, offs);
+	for (unsigned i = 0; i < NUM_OPS; ++i) {
+		const struct optab_ent *opc = m6502_optab + i;
+		const uint16_t *modes = m6502_modes[opc->group & 0x7f];
+		for (int mode = 0; mode < AM_COUNT; ++mode) {
+			unsigned info = modes[mode];
+			m6502_matrix[i][mode].code = opc->base + (info & 0x7f);
+			m6502_matrix[i][mode].info = (info >> 8) | (info & CMOS ? ENC_CMOS : 0);
 		}
-		else
-			m6502_auto_pick(inp, opc, m6502_zp, m6502_abs, value, "absolute");
+		for (int j = 0; j < sizeof(m6502_except) / sizeof(m6502_except[0]); ++j) {
+			if (!memcmp(m6502_except[j].mnemonic, opc->mnemonic, 4)) {
+				unsigned info = m6502_except[j].info;
+				m6502_matrix[i][m6502_except[j].mode].code = m6502_except[j].code;
+				m6502_matrix[i][m6502_except[j].mode].info = (info >> 8) | (info & CMOS ? ENC_CMOS : 0);
+			}
+		}
+		asm_opword(opc->mnemonic, OP_M6502, opc);
 	}
 }
 
-#include "charclass.h"
-
-bool m6502_op(struct inctx *inp, const char *opname)
+void m6502_op(struct inctx *inp, const struct optab_ent *opc)
 {
-	const struct optab_ent *opc = m6502_optab;
-	const struct optab_ent *end = m6502_optab + sizeof(m6502_optab) / sizeof(struct optab_ent);
-	while (opc < end) {
-		if (!memcmp(opname, opc->mnemonic, 3)) {
-			if ((opc->group & 0x80) && no_cmos)
-				asm_error(inp, cmos_only_in, opc->mnemonic);
-			else {
-				int ch = non_space(inp);
-				if (asm_isendchar(ch))
-					m6502_implied(inp, opc);
-				else if (ch == '#')
-					m6502_immediate(inp, opc);
-				else if (ch == '(')
-					m6502_indirect(inp, opc);
-				else if (ch == 'A' || ch == 'a') {
-					ch = inp->lineptr[1];
-					if (asm_isspace(ch) || asm_isendchar(ch))
-						m6502_accumulator(inp, opc);
-					else
-						m6502_others(inp, opc);
-				}
-				else
-					m6502_others(inp, opc);
-			}
-			return true;
+	if ((opc->group & 0x80) && no_cmos)
+		asm_error(inp, cmos_only_in, opc->mnemonic);
+	else {
+		uint16_t value = 0;
+		const char *expr = NULL;
+		enum m6502_mode mode = m6502_mode(inp, m6502_matrix[opc - m6502_optab], &value, &expr);
+		if (mode != AM_NONE)
+			m6502_encode(inp, opc, mode, value, expr && one_pass && expr_forward);
+		if (expr && one_pass && expr_forward) {
+			enum fixkind kind = FIX_BYTE;
+			if (mode == AM_ABS && m6502_matrix[opc - m6502_optab][AM_REL].info)
+				kind = FIX_REL;
+			else if (objcode.used == 3)
+				kind = FIX_WORD;
+			m6502_forward(inp, expr, kind);
 		}
-		++opc;
 	}
-	return false;
 }
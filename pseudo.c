@@ -5,11 +5,14 @@
 
 #include "charclass.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static enum action pseudo_equ(struct inctx *inp, struct symbol *sym)
 {
 	if (sym) {
-		uint16_t value = expression(inp, passno);
-		sym->value = value;
+		uint16_t value = symbol_equ(inp, sym);
 		list_value = value;
 		list_char = '=';
 	}
@@ -25,26 +28,88 @@ static enum action pseudo_org(struct inctx *inp, struct symbol *sym)
 	return ACT_CONTINUE;
 }
 
+/*
+ * On pass 1 only the length of the code generated matters so the
+ * planting functions just count bytes and store nothing.
+ */
+
+static void plant_ch(int ch)
+{
+	if (passno)
+		dstr_add_ch(&objcode, ch);
+	else
+		++objcode.used;
+}
+
+static void plant_run(const char *src, size_t len)
+{
+	if (passno)
+		dstr_add_bytes(&objcode, src, len);
+	else
+		objcode.used += len;
+}
+
+/*
+ * Find the end of a run of characters in a string that need no
+ * translation, i.e. the next escape, closing quote or end of line.
+ */
+
+static const char *asc_run(const char *ptr, const char *end, int endq)
+{
+#ifdef __SSE2__
+	const __m128i vbar = _mm_set1_epi8('|');
+	const __m128i vhat = _mm_set1_epi8('^');
+	const __m128i vnl = _mm_set1_epi8('\n');
+	const __m128i vq = _mm_set1_epi8(endq);
+	while (ptr + 16 <= end) {
+		__m128i v = _mm_loadu_si128((const __m128i *)ptr);
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, vbar), _mm_cmpeq_epi8(v, vhat)),
+		                           _mm_or_si128(_mm_cmpeq_epi8(v, vnl), _mm_cmpeq_epi8(v, vq)));
+		unsigned mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return ptr + __builtin_ctz(mask);
+		ptr += 16;
+	}
+#endif
+	for (;;) {
+		int ch = *ptr;
+		if (ch == '|' || ch == '^' || ch == endq || ch == '\n')
+			return ptr;
+		++ptr;
+	}
+}
+
 static enum action pseudo_asc(struct inctx *inp, struct symbol *sym)
 {
 	int ch = non_space(inp);
 	if (ch == '"' || ch == '\'') {
 		int endq = ch;
-		while ((ch = *++inp->lineptr) != endq && ch != '\n') {
-			if (ch == '|' || ch == '^') {
-				int ch2 = *++inp->lineptr;
-				if (ch2 == endq) {
-					asm_error(inp, "bad character sequence");
-					break;
-				}
-				if (ch2 != ch) {
-					if (ch == '|')
-						ch = ch2 & 0x1f;
-					else
-						ch = ch2 | 0x80;
-				}
+		const char *end = inp->line.str + inp->line.used;
+		++inp->lineptr;
+		for (;;) {
+			const char *run = inp->lineptr;
+			inp->lineptr = (char *)asc_run(run, end, endq);
+			plant_run(run, inp->lineptr - run);
+			ch = *inp->lineptr;
+			if (ch == endq || ch == '\n')
+				break;
+			int ch2 = *++inp->lineptr;
+			if (ch2 == endq) {
+				asm_error(inp, "bad character sequence");
+				break;
+			}
+			if (ch2 != ch) {
+				if (ch == '|')
+					ch = ch2 & 0x1f;
+				else
+					ch = ch2 | 0x80;
 			}
-			dstr_add_ch(&objcode, ch);
+			plant_ch(ch);
+			if (ch2 == '\n') {
+				ch = ch2;
+				break;
+			}
+			++inp->lineptr;
 		}
 		if (ch != endq)
 			asm_error(inp, "missing closing quote");
@@ -57,7 +122,7 @@ static enum action pseudo_asc(struct inctx *inp, struct symbol *sym)
 static enum action pseudo_str(struct inctx *inp, struct symbol *sym)
 {
 	pseudo_asc(inp, sym);
-	dstr_add_ch(&objcode, '\r');
+	plant_ch('\r');
 	return ACT_CONTINUE;
 }
 
@@ -65,7 +130,7 @@ static enum action pseudo_dc(struct inctx *inp, struct symbol *sym)
 {
 	size_t used = objcode.used;
 	pseudo_asc(inp, sym);
-	if (objcode.used > used)
+	if (passno && objcode.used > used)
 		objcode.str[objcode.used-1] |= 0x80;
 	return ACT_CONTINUE;
 }
@@ -75,13 +140,14 @@ static void plant_length(struct inctx *inp, size_t posn)
 	size_t len = objcode.used - posn;
 	if (len > 0xff)
 		asm_error(inp, "string too long for single-byte count");
-	objcode.str[posn] = len;
+	if (passno)
+		objcode.str[posn] = len;
 }
 
 static enum action pseudo_casc(struct inctx *inp, struct symbol *sym)
 {
 	size_t posn = objcode.used;
-	dstr_add_ch(&objcode, 0); /* length to be filled in later */
+	plant_ch(0); /* length to be filled in later */
 	pseudo_asc(inp, sym);
 	plant_length(inp, posn);
 	return ACT_CONTINUE;
@@ -90,22 +156,28 @@ static enum action pseudo_casc(struct inctx *inp, struct symbol *sym)
 static enum action pseudo_cstr(struct inctx *inp, struct symbol *sym)
 {
 	size_t posn = objcode.used;
-	dstr_add_ch(&objcode, 0); /* length to be filled in later */
+	plant_ch(0); /* length to be filled in later */
 	pseudo_asc(inp, sym);
-	dstr_add_ch(&objcode, '\r');
+	plant_ch('\r');
 	plant_length(inp, posn);
 	return ACT_CONTINUE;
 }
 
 static void plant_bytes(struct inctx *inp, size_t count, uint16_t byte)
 {
-	dstr_grow(&objcode, count);
-	memset(objcode.str + objcode.used, byte, count);
+	if (passno) {
+		dstr_grow(&objcode, count);
+		memset(objcode.str + objcode.used, byte, count);
+	}
 	objcode.used += count;
 }
 
 static void plant_words(struct inctx *inp, size_t count, uint16_t word)
 {
+	if (!passno) {
+		objcode.used += count << 1;
+		return;
+	}
 	dstr_grow(&objcode, count << 1);
 	char high = word >> 8;
 	while (count--) {
@@ -116,6 +188,10 @@ static void plant_words(struct inctx *inp, size_t count, uint16_t word)
 
 static void plant_dbytes(struct inctx *inp, size_t count, uint16_t word)
 {
+	if (!passno) {
+		objcode.used += count << 1;
+		return;
+	}
 	dstr_grow(&objcode, count << 1);
 	char high = word >> 8;
 	while (count--) {
@@ -124,7 +200,20 @@ static void plant_dbytes(struct inctx *inp, size_t count, uint16_t word)
 	}
 }
 
-static void plant_item(struct inctx *inp, int ch, void (*planter)(struct inctx *inp, size_t count, uint16_t value))
+static void plant_value(struct inctx *inp, size_t count, void (*planter)(struct inctx *inp, size_t count, uint16_t value), enum fixkind kind)
+{
+	size_t posn = objcode.used;
+	const char *expr = inp->lineptr;
+	uint16_t value = expression(inp, !pass_defines);
+	if (one_pass && expr_forward) {
+		planter(inp, count, 0);
+		fixup_add(inp, expr, posn, count, kind);
+	}
+	else
+		planter(inp, count, value);
+}
+
+static void plant_item(struct inctx *inp, int ch, void (*planter)(struct inctx *inp, size_t count, uint16_t value), enum fixkind kind)
 {
 	if (ch == '[') {
 		++inp->lineptr;
@@ -132,41 +221,95 @@ static void plant_item(struct inctx *inp, int ch, void (*planter)(struct inctx *
 		ch = non_space(inp);
 		if (ch == ']') {
 			++inp->lineptr;
-			planter(inp, count, expression(inp, passno));
+			plant_value(inp, count, planter, kind);
 		}
 		else
 			asm_error(inp, "missing ]");
 	}
 	else
-		planter(inp, 1, expression(inp, passno));
+		plant_value(inp, 1, planter, kind);
 }
 
-static void plant_data(struct inctx *inp, const char *desc, void (*planter)(struct inctx *inp, size_t count, uint16_t value))
+/*
+ * Data lists are often long runs of plain numbers, as in generated
+ * tables, so these are planted directly, straight into space reserved
+ * for the whole list, without going through expression.  This plants
+ * items for as long as they are plain numbers, returning true if the
+ * end of the list was reached or false with the line pointer at the
+ * start of an item that needs evaluating in full.
+ */
+
+static bool plant_literals(struct inctx *inp, enum fixkind kind)
+{
+	int width = kind == FIX_BYTE ? 1 : 2;
+	char *out = NULL;
+	if (passno) {
+		/* every item but the last takes at least two characters */
+		const char *end = inp->line.str + inp->line.used;
+		dstr_grow(&objcode, ((end - inp->lineptr) / 2 + 1) * width);
+		out = objcode.str + objcode.used;
+	}
+	size_t count = 0;
+	bool done = false;
+	for (;;) {
+		char *item = inp->lineptr;
+		unsigned value;
+		non_space(inp);
+		if (!expr_literal(inp, &value)) {
+			inp->lineptr = item;
+			break;
+		}
+		int ch = non_space(inp);
+		if (ch != ',' && !asm_isendchar(ch)) {
+			inp->lineptr = item;
+			break;
+		}
+		if (out) {
+			if (kind == FIX_DBYTE)
+				*out++ = value >> 8;
+			*out++ = value;
+			if (kind == FIX_WORD)
+				*out++ = value >> 8;
+		}
+		++count;
+		++inp->lineptr;
+		if (ch != ',') {
+			done = true;
+			break;
+		}
+	}
+	objcode.used += count * width;
+	return done;
+}
+
+static void plant_data(struct inctx *inp, const char *desc, void (*planter)(struct inctx *inp, size_t count, uint16_t value), enum fixkind kind)
 {
 	int ch;
 	do {
-		plant_item(inp, non_space(inp), planter);
+		if (plant_literals(inp, kind))
+			return;
+		plant_item(inp, non_space(inp), planter, kind);
 		ch = *inp->lineptr++;
 	} while (ch == ',');
-	if (ch != '\n' && ch != ';' && ch != '\\' && ch != '*')
+	if (!asm_isendchar(ch))
 		asm_error(inp, "bad %s expression", desc);
 }
 
 static enum action pseudo_dfb(struct inctx *inp, struct symbol *sym)
 {
-	plant_data(inp, "byte", plant_bytes);
+	plant_data(inp, "byte", plant_bytes, FIX_BYTE);
 	return ACT_CONTINUE;
 }
 
 static enum action pseudo_dfw(struct inctx *inp, struct symbol *sym)
 {
-	plant_data(inp, "word", plant_words);
+	plant_data(inp, "word", plant_words, FIX_WORD);
 	return ACT_CONTINUE;
 }
 
 static enum action pseudo_dfdb(struct inctx *inp, struct symbol *sym)
 {
-	plant_data(inp, "double-byte", plant_dbytes);
+	plant_data(inp, "double-byte", plant_dbytes, FIX_DBYTE);
 	return ACT_CONTINUE;
 }
 
@@ -180,37 +323,88 @@ static enum action pseudo_data(struct inctx *inp, struct symbol *sym)
 {
 	int ch;
 	do {
+		if (plant_literals(inp, FIX_BYTE))
+			return ACT_CONTINUE;
 		ch = non_space(inp);
 		if (ch == '"' || ch == '\'') {
 			pseudo_asc(inp, sym);
 			++inp->lineptr;
 		}
 		else
-			plant_item(inp, ch, plant_bytes);
+			plant_item(inp, ch, plant_bytes, FIX_BYTE);
 		ch = *inp->lineptr++;
 	} while (ch == ',');
-	if (ch != '\n' && ch != ';' && ch != '\\' && ch != '*')
+	if (!asm_isendchar(ch))
 		asm_error(inp, "bad %s expression", "data");
 	return ACT_CONTINUE;
 }
 
 static unsigned hex_nyb(struct inctx *inp, int ch)
 {
-	if (ch >= '0' && ch <= '9')
-		return ch - '0';
-	if (ch >= 'A' && ch <= 'F')
-		return ch - 'A' + 10;
-	if (ch >= 'a' && ch <= 'f')
-		return ch - 'a' + 10;
+	if (asm_ishex(ch))
+		return asm_hexval(ch);
 	asm_error(inp, "bad hex digit '%c'", ch);
 	return 0;
 }
 
+#ifdef __SSE2__
+
+/*
+ * Long HEX strings are converted 32 digits at a time.  Each block of
+ * 32 is checked to be all hex digits, in which case the digits are
+ * converted to nybbles, paired into bytes and stored, otherwise the
+ * rest of the string is left for the digit at a time loop.
+ */
+
+static __m128i hex_nybbles(__m128i v, unsigned *valid)
+{
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+	                              _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+	                               _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+	*valid &= _mm_movemask_epi8(_mm_or_si128(digit, letter));
+	__m128i nyb = _mm_add_epi8(_mm_and_si128(v, _mm_set1_epi8(0x0f)),
+	                           _mm_and_si128(letter, _mm_set1_epi8(9)));
+	/* pair the high nybble in each even byte with the low one after it */
+	return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nyb, _mm_set1_epi16(0x00ff)), 4), _mm_srli_epi16(nyb, 8));
+}
+
+static void hex_bulk(struct inctx *inp)
+{
+	const char *end = inp->line.str + inp->line.used;
+	size_t blocks = (end - inp->lineptr) / 32;
+	if (!blocks)
+		return;
+	if (passno)
+		dstr_grow(&objcode, blocks * 16);
+	while (blocks--) {
+		unsigned valid = 0xffff;
+		__m128i a = hex_nybbles(_mm_loadu_si128((const __m128i *)inp->lineptr), &valid);
+		__m128i b = hex_nybbles(_mm_loadu_si128((const __m128i *)(inp->lineptr + 16)), &valid);
+		if (valid != 0xffff)
+			break;
+		if (passno)
+			_mm_storeu_si128((__m128i *)(objcode.str + objcode.used), _mm_packus_epi16(a, b));
+		objcode.used += 16;
+		inp->lineptr += 32;
+	}
+}
+
+#endif
+
 static enum action pseudo_hex(struct inctx *inp, struct symbol *sym)
 {
 	int ch = non_space(inp);
 	if (ch == '"' || ch == '\'') {
 		int endq = ch;
+#ifdef __SSE2__
+		if (!err_message) {
+			++inp->lineptr;
+			hex_bulk(inp);
+			--inp->lineptr;
+		}
+#endif
 		while ((ch = *++inp->lineptr) != endq && ch != '\n') {
 			unsigned byte = hex_nyb(inp, ch);
 			if (err_message)
@@ -333,96 +527,123 @@ static enum action pseudo_dend(struct inctx *inp, struct symbol *sym)
 	return ACT_CONTINUE;
 }
 
-static FILE *parse_open(struct inctx *inp, struct dstring *fn, const char *mode)
+/*
+ * File names are kept in the pass arena as an included or chained file's
+ * name is referred to by its input context, and by any forward references
+ * from it, after the directive naming it has been dealt with.
+ */
+static const char *parse_name(struct inctx *inp)
 {
-	dstr_empty(fn, 20);
 	int ch = non_space(inp);
-	while (ch != '\n' && ch != ' ' && ch != '\t' && ch != 0xdd) {
-		dstr_add_ch(fn, ch);
+	const char *start = inp->lineptr;
+	while (ch != '\n' && !asm_isspace(ch))
 		ch = *++inp->lineptr;
-	}
-	dstr_add_ch(fn, 0);
-	return fopen(fn->str, mode);
+	return arena_strndup(&pass_arena, start, inp->lineptr - start);
 }
 
 static enum action pseudo_chn(struct inctx *inp, struct symbol *sym)
 {
-	struct dstring filename;
-	FILE *fp = parse_open(inp, &filename, "r");
-	if (fp) {
+	const char *filename = parse_name(inp);
+	struct srcfile *sf = srcfile_open(filename);
+	if (sf) {
 		/* find the most local input context that is a file. */
 		struct inctx *ctx = inp;
-		while (ctx && !ctx->fp)
+		while (ctx && !ctx->src)
 			ctx = ctx->parent;
 		if (ctx) {
-			fclose(ctx->fp);
-			ctx->fp = fp;
-			ctx->name = filename.str;
+			ctx->src = sf;
+			ctx->fline = 0;
+			ctx->name = filename;
 			ctx->next_line = 1;
 			return ACT_CONTINUE;
 		}
-		else {
-			fclose(fp);
+		else
 			asm_error(inp, "failed to chain file, failed to find file-based context");
-		}
-	}
-	else {
-		asm_error(inp, "unable to open chained file %.*s: %s", (int)filename.used, filename.str, strerror(errno));
-		free(filename.str);
 	}
+	else
+		asm_error(inp, "unable to open chained file %s: %s", filename, strerror(errno));
 	return ACT_STOP;
 }
 
+/*
+ * A file wrapped entirely in IFNDEF sym ... FI assembles nothing once
+ * sym is defined so, unless the skipped lines are to be listed, the
+ * whole file can be passed over without reading it.
+ */
+static bool include_guarded(struct inctx *inp, struct srcfile *sf)
+{
+	if (!sf->guard || (passno && list_fp && (list_opts & LISTO_ENABLED)))
+		return false;
+	struct inctx gctx = *inp;
+	gctx.ir = NULL;
+	gctx.lineptr = (char *)sf->guard;
+	return symbol_defined(&gctx);
+}
+
 enum action pseudo_include(struct inctx *inp)
 {
 	enum action act;
-	struct dstring filename;
-	FILE *fp = parse_open(inp, &filename, "r");
-	if (fp) {
-		struct inctx incfile;
-		dstr_empty(&incfile.line, MIN_LINE);
-		dstr_empty(&incfile.wcond, 0);
-		incfile.parent = inp;
-		incfile.fp = fp;
-		incfile.name = filename.str;
-		incfile.whence = 'I';
+	const char *filename = parse_name(inp);
+	struct srcfile *sf = srcfile_open(filename);
+	if (sf && include_guarded(inp, sf)) {
 		list_line(inp);
-		act = asm_file(&incfile);
-		if (incfile.line.allocated)
-			free(incfile.line.str);
-		if (incfile.wcond.allocated)
-			free(incfile.wcond.str);
+		act = ACT_CONTINUE;
+	}
+	else if (sf) {
+		struct inctx *incfile = asm_nest_file(inp);
+		list_line(inp);
+		if (incfile) {
+			dstr_empty(&incfile->line, 0);
+			incfile->wcond = NULL;
+			incfile->parent = inp;
+			incfile->src = sf;
+			incfile->name = filename;
+			incfile->whence = 'I';
+			act = asm_file(incfile);
+			asm_unnest();
+		}
+		else
+			act = ACT_CONTINUE;
 	}
 	else {
-		asm_error(inp, "unable to open include file %.*s: %s", (int)filename.used, filename.str, strerror(errno));
+		asm_error(inp, "unable to open include file %s: %s", filename, strerror(errno));
 		list_line(inp);
 		act = ACT_STOP;
 	}
-	free(filename.str);
 	return act;
 }
 
 static enum action pseudo_code(struct inctx *inp, struct symbol *sym)
 {
 	enum action act = ACT_CONTINUE;
-	struct dstring filename;
-	FILE *fp = parse_open(inp, &filename, "rb");
-	if (fp) {
-		fseek(fp, 0, SEEK_END);
-		size_t size = ftell(fp);
-		rewind(fp);
-		dstr_grow(&objcode, size);
-		if (fread(objcode.str, size, 1, fp) == 1) {
-			objcode.used = size;
-			codefile = true;
+	const char *filename = parse_name(inp);
+	long size = codefile_open(filename);
+	if (size >= 0) {
+		codefile = true;
+		size_t offset = 0, length = size;
+		int ch = non_space(inp);
+		if (!asm_isendchar(ch)) {
+			offset = expression(inp, true);
+			if (*inp->lineptr == ',') {
+				++inp->lineptr;
+				length = expression(inp, true);
+			}
+			else if (offset <= size)
+				length = size - offset;
 		}
-		else {
-			asm_error(inp, "read error on code file %.*s: %s", (int)filename.used, filename.str, strerror(errno));
+		if (offset > size)
+			asm_error(inp, "offset %lu is beyond the end of code file %s", (unsigned long)offset, filename);
+		else if (length > size - offset)
+			asm_error(inp, "length %lu from offset %lu is beyond the end of code file %s", (unsigned long)length, (unsigned long)offset, filename);
+		else if (!codefile_slice(offset, length)) {
+			asm_error(inp, "read error on code file %s: %s", filename, strerror(errno));
 			act = ACT_STOP;
 		}
-		fclose(fp);
 	}
-	free(filename.str);
+	else {
+		asm_error(inp, "unable to open code file %s: %s", filename, strerror(errno));
+		act = ACT_STOP;
+	}
 	return act;
 }
 
@@ -441,12 +662,13 @@ static const char *simple_str(struct inctx *inp, int ch)
 
 static enum action pseudo_query(struct inctx *inp, struct symbol *sym)
 {
-	if (!passno && !err_message) {
+	if (pass_defines && !err_message) {
 		int ch = non_space(inp);
 		if (ch != '\n') {
 			struct inctx qtx;
+			qtx.ir = NULL;
 			qtx.parent = inp;
-			qtx.fp = NULL;
+			qtx.src = NULL;
 			qtx.name = "query";
 			qtx.lineno = 0;
 			qtx.line.str = NULL;
@@ -468,13 +690,19 @@ static enum action pseudo_query(struct inctx *inp, struct symbol *sym)
 							err_message = NULL;
 						}
 						else {
-							sym->value = value;
+							sym->def = NULL;
+							symbol_set(sym, value);
 							list_value = value;
 							list_char = '=';
 							return ACT_CONTINUE;
 						}
 					}
 				}
+				else {
+					/* the source itself may have come from stdin */
+					asm_error(inp, "end of input waiting for QUERY reply");
+					break;
+				}
 			}
 			if (qtx.line.allocated)
 				free(qtx.line.str);
@@ -574,7 +802,7 @@ static enum action pseudo_disp(struct inctx *inp, struct symbol *sym)
 
 static enum action pseudo_disp1(struct inctx *inp, struct symbol *sym)
 {
-	if (!passno)
+	if (pass_defines)
 		pseudo_disp(inp, sym);
 	return ACT_CONTINUE;
 }
@@ -589,7 +817,7 @@ static enum action pseudo_disp2(struct inctx *inp, struct symbol *sym)
 static enum action pseudo_tabs(struct inctx *inp, struct symbol *sym)
 {
 	int ch = non_space(inp);
-	if (ch == '\n' || ch == ';' || ch == '\\' || ch == '*')
+	if (asm_isendchar(ch))
 		memcpy(tab_stops, default_tabs, sizeof(tab_stops));
 	else {
 		int tab;
@@ -650,7 +878,7 @@ static enum action pseudo_repeat(struct inctx *inp, struct symbol *sym)
 static enum action pseudo_until(struct inctx *inp, struct symbol *sym)
 {
 	if (inp->rpt_line) {
-		if (inp->wcond.used)
+		if (inp->wcond)
 			asm_error(inp, "Expected WEND, to match WHILE, not UNTIL");
 		else {
 			int value = expression(inp, true);
@@ -669,13 +897,12 @@ static enum action pseudo_while(struct inctx *inp, struct symbol *sym)
 	if (inp->rpt_line)
 		asm_error(inp, "REPEAT or WHILE already active");
 	else {
-		non_space(inp);
-		const char *start = inp->lineptr;
-		int value = expression(inp, true);
+		struct exprcode *cond;
+		int value = expr_keep(inp, true, &cond);
 		if (!value || err_message)
 			inp->wend_skipping = true;
 		else {
-			dstr_add_bytes(&inp->wcond, start, inp->lineptr - start);
+			inp->wcond = cond;
 			inp->rpt_line = inp->lineno;
 			return ACT_RMARK;
 		}
@@ -718,74 +945,87 @@ static enum action pseudo_assign(struct inctx *inp, struct symbol *sym)
 struct op_type {
 	char name[8];
 	enum action (*func)(struct inctx *inp, struct symbol *sym);
+	bool sets_label; /* label takes a value other than org */
 };
 
 static const struct op_type pseudo_ops[] = {
-	{ "ASC",     pseudo_asc     },
-	{ "BLOCK",   pseudo_block   },
-	{ "CASC",    pseudo_casc    },
-	{ "CHN",     pseudo_chn     },
-	{ "CLST",    pseudo_clst    },
-	{ "CODE",    pseudo_code    },
-	{ "CSTR",    pseudo_cstr    },
-	{ "DATA",    pseudo_data    },
-	{ "DB",      pseudo_dfb     },
-	{ "DC",      pseudo_dc      },
-	{ "DDB",     pseudo_dfdb    },
-	{ "DEND",    pseudo_dend    },
-	{ "DFB",     pseudo_dfb     },
-	{ "DFS",     pseudo_ds      },
-	{ "DFW",     pseudo_dfw     },
-	{ "DISP",    pseudo_disp    },
-	{ "DISP1",   pseudo_disp1   },
-	{ "DISP2",   pseudo_disp2   },
-	{ "DSECT",   pseudo_dsect   },
-	{ "DS",      pseudo_ds      },
-	{ "DW",      pseudo_dfw     },
-	{ "DFDB",    pseudo_dfdb    },
-	{ "ENDM",    pseudo_endm    },
-	{ "END",     pseudo_end     },
-	{ "EQU",     pseudo_equ     },
-	{ "EXEC",    pseudo_exec    },
-	{ "HEX",     pseudo_hex     },
-	{ "INFO",    pseudo_disp2   },
-	{ "LFCOND",  pseudo_lfcond  },
-	{ "LISTO",   pseudo_listo   },
-	{ "LOAD",    pseudo_load    },
-	{ "LST",     pseudo_lst     },
-	{ "MSW",     pseudo_msw     },
-	{ "ORG",     pseudo_org     },
-	{ "PAGE",    pseudo_page    },
-	{ "QUERY",   pseudo_query   },
-	{ "REPEAT",  pseudo_repeat  },
-	{ "SFCOND",  pseudo_sfcond  },
-	{ "SKP",     pseudo_skp     },
-	{ "STOP",    pseudo_stop    },
-	{ "STR",     pseudo_str     },
-	{ "TABS",    pseudo_tabs    },
-	{ "TTL",     pseudo_ttl     },
-	{ "UNTIL",   pseudo_until   },
-	{ "WIDTH",   pseudo_width   },
-	{ "WHILE",   pseudo_while   },
-	{ "=",       pseudo_assign  }
+	{ "ASC",     pseudo_asc,    false },
+	{ "BLOCK",   pseudo_block,  false },
+	{ "CASC",    pseudo_casc,   false },
+	{ "CHN",     pseudo_chn,    false },
+	{ "CLST",    pseudo_clst,   false },
+	{ "CODE",    pseudo_code,   false },
+	{ "CSTR",    pseudo_cstr,   false },
+	{ "DATA",    pseudo_data,   false },
+	{ "DB",      pseudo_dfb,    false },
+	{ "DC",      pseudo_dc,     false },
+	{ "DDB",     pseudo_dfdb,   false },
+	{ "DEND",    pseudo_dend,   false },
+	{ "DFB",     pseudo_dfb,    false },
+	{ "DFS",     pseudo_ds,     false },
+	{ "DFW",     pseudo_dfw,    false },
+	{ "DISP",    pseudo_disp,   false },
+	{ "DISP1",   pseudo_disp1,  false },
+	{ "DISP2",   pseudo_disp2,  false },
+	{ "DSECT",   pseudo_dsect,  false },
+	{ "DS",      pseudo_ds,     false },
+	{ "DW",      pseudo_dfw,    false },
+	{ "DFDB",    pseudo_dfdb,   false },
+	{ "ENDM",    pseudo_endm,   false },
+	{ "END",     pseudo_end,    false },
+	{ "EQU",     pseudo_equ,    true  },
+	{ "EXEC",    pseudo_exec,   false },
+	{ "HEX",     pseudo_hex,    false },
+	{ "INFO",    pseudo_disp2,  false },
+	{ "LFCOND",  pseudo_lfcond, false },
+	{ "LISTO",   pseudo_listo,  false },
+	{ "LOAD",    pseudo_load,   false },
+	{ "LST",     pseudo_lst,    false },
+	{ "MSW",     pseudo_msw,    false },
+	{ "ORG",     pseudo_org,    true  },
+	{ "PAGE",    pseudo_page,   false },
+	{ "QUERY",   pseudo_query,  true  },
+	{ "REPEAT",  pseudo_repeat, false },
+	{ "SFCOND",  pseudo_sfcond, false },
+	{ "SKP",     pseudo_skp,    false },
+	{ "STOP",    pseudo_stop,   false },
+	{ "STR",     pseudo_str,    false },
+	{ "SYSCLI",  NULL,          false },
+	{ "SYSFX",   NULL,          false },
+	{ "SYSVDU",  NULL,          false },
+	{ "SYSVDU1", NULL,          false },
+	{ "SYSVDU2", NULL,          false },
+	{ "TABS",    pseudo_tabs,   false },
+	{ "TTL",     pseudo_ttl,    false },
+	{ "UNTIL",   pseudo_until,  false },
+	{ "WIDTH",   pseudo_width,  false },
+	{ "WHILE",   pseudo_while,  false },
+	{ "=",       pseudo_assign, false }
 };
 
-enum action pseudo_op(struct inctx *inp, const char *opname, size_t opsize, struct symbol *sym)
+void pseudo_opwords(void)
 {
 	const struct op_type *ptr = pseudo_ops;
 	const struct op_type *end = pseudo_ops + sizeof(pseudo_ops) / sizeof(struct op_type);
 	while (ptr < end) {
-		if (!strcmp(opname, ptr->name))
-			return ptr->func(inp, sym);
+		asm_opword(ptr->name, ptr->func == pseudo_assign ? OP_ASSIGN : OP_PSEUDO, ptr);
 		++ptr;
 	}
-	if (!strncmp(opname, "SYS", 3)) {
-		const char *tail = opname + 3;
-		if (!strcmp(tail, "CLI") || !strcmp(tail, "FX") || !strcmp(tail, "VDU") || !strcmp(tail, "VDU1") || !strcmp(tail, "VDU2")) {
-			if (!passno)
-				fprintf(stderr, "%s:%u:%d: warning: directive %s ignored\n", inp->name, inp->lineno, (int)(inp->lineptr - inp->line.str), opname);
-			return ACT_CONTINUE;
-		}
-	}
-	return ACT_NOTFOUND;
+}
+
+/* Whether a directive gives its label a value other than the current org. */
+
+bool pseudo_sets_label(const struct op_type *op)
+{
+	return op->sets_label;
+}
+
+enum action pseudo_op(struct inctx *inp, const struct op_type *op, struct symbol *sym)
+{
+	if (op->func)
+		return op->func(inp, sym);
+	/* recognised for compatibility but ignored */
+	if (pass_defines)
+		fprintf(stderr, "%s:%u:%d: warning: directive %s ignored\n", inp->name, inp->lineno, (int)(inp->lineptr - inp->line.str), op->name);
+	return ACT_CONTINUE;
 }
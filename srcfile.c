@@ -0,0 +1,847 @@
+#define _GNU_SOURCE
+#include "laxasm.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __WIN32__
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Source files are loaded whole, memory-mapped where possible, and
+ * prepared with a single sweep so that the assembler can take each
+ * line directly from the file's buffer without copying it.
+ *
+ * After loading, every line, including the last, ends with '\n'
+ * whatever the line ending used in the file and every 0xDD byte
+ * (the BBC micro's TAB key) has been replaced with a tab, the latter
+ * as part of building the line index below.
+ */
+
+static void srcfile_sweep(struct srcfile *sf)
+{
+	char *ptr = sf->data;
+	char *end = ptr + sf->size;
+
+	/* The first CR or LF found sets the line ending in use. */
+	int delim = '\n';
+	while (ptr < end) {
+		int ch = *ptr++;
+		if (ch == '\r' || ch == '\n') {
+			delim = ch;
+			break;
+		}
+	}
+	if (delim != '\n') {
+		ptr = sf->data;
+		while ((ptr = memchr(ptr, delim, end - ptr)))
+			*ptr++ = '\n';
+	}
+}
+
+static bool srcfile_read(struct srcfile *sf, FILE *fp)
+{
+	size_t size = 0, allocated = 0;
+	char *data = NULL;
+	do {
+		if (size == allocated) {
+			allocated = allocated ? allocated << 1 : 4096;
+			if (!(data = realloc(data, allocated + 1)))
+				return false;
+		}
+		size += fread(data + size, 1, allocated - size, fp);
+	} while (!feof(fp) && !ferror(fp));
+	if (ferror(fp)) {
+		free(data);
+		return false;
+	}
+	sf->data = data;
+	sf->size = size;
+	sf->mapped = 0;
+	return true;
+}
+
+static bool srcfile_load(struct srcfile *sf, const char *name)
+{
+#ifdef __WIN32__
+	FILE *fp = fopen(name, "rb");
+	if (!fp)
+		return false;
+	bool ok = srcfile_read(sf, fp);
+	fclose(fp);
+	return ok;
+#else
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat stb;
+	sf->mapped = 0;
+	if (fstat(fd, &stb) == 0 && S_ISREG(stb.st_mode) && stb.st_size > 0) {
+		/* Map one extra byte where that stays within the last page
+		 * so a newline can be added to an unterminated last line.
+		 */
+		size_t size = stb.st_size;
+		size_t extra = (size % sysconf(_SC_PAGESIZE)) ? 1 : 0;
+		void *map = mmap(NULL, size + extra, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, size, MADV_SEQUENTIAL);
+			sf->data = map;
+			sf->size = size;
+			sf->mapped = size + extra;
+			if (!extra && sf->data[size-1] != '\n') {
+				/* no room for the newline, fall back to a copy */
+				munmap(map, sf->mapped);
+				sf->mapped = 0;
+			}
+		}
+	}
+	if (sf->mapped) {
+		close(fd);
+		return true;
+	}
+	FILE *fp = fdopen(fd, "rb");
+	if (!fp) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return false;
+	}
+	bool ok = srcfile_read(sf, fp);
+	int err = errno;
+	fclose(fp);
+	errno = err;
+	return ok;
+#endif
+}
+
+__attribute__((noreturn))
+static void srcfile_nomem(size_t bytes)
+{
+	fprintf(stderr, "laxasm: Out of memory trying to allocate %lu bytes\n", (unsigned long)bytes);
+	abort();
+}
+
+/*
+ * The line index gives the offset of the start of each line, with
+ * one extra entry for the end of the last line, so lines can be
+ * revisited, by REPEAT or a later pass, without searching again.
+ *
+ * It is built by a single scan of the file that also replaces each
+ * 0xDD with a tab and notes, for each line, whether it contains a tab
+ * or an '@' so the listing and MACRO code need not search lines that
+ * have neither.  Where SSE2 is available the scan takes sixteen bytes
+ * at a time.
+ */
+
+struct scan_state {
+	uint32_t *lines;
+	uint8_t *flags;
+	size_t allocated;
+	unsigned nlines;
+	uint32_t start;
+	uint8_t cur;
+};
+
+static void scan_line_end(struct scan_state *st, size_t posn)
+{
+	if (st->nlines + 1 >= st->allocated) {
+		st->allocated <<= 1;
+		if (!(st->lines = realloc(st->lines, st->allocated * sizeof(uint32_t))))
+			srcfile_nomem(st->allocated * sizeof(uint32_t));
+		if (!(st->flags = realloc(st->flags, st->allocated)))
+			srcfile_nomem(st->allocated);
+	}
+	st->lines[st->nlines] = st->start;
+	st->flags[st->nlines++] = st->cur;
+	st->start = posn + 1;
+	st->cur = 0;
+}
+
+static void srcfile_index(struct srcfile *sf)
+{
+	struct scan_state st;
+	st.allocated = 1024;
+	if (!(st.lines = malloc(st.allocated * sizeof(uint32_t))))
+		srcfile_nomem(st.allocated * sizeof(uint32_t));
+	if (!(st.flags = malloc(st.allocated)))
+		srcfile_nomem(st.allocated);
+	st.nlines = 0;
+	st.start = 0;
+	st.cur = 0;
+	uint8_t *data = (uint8_t *)sf->data;
+	size_t size = sf->size, posn = 0;
+#ifdef __SSE2__
+	const __m128i vnl = _mm_set1_epi8('\n');
+	const __m128i vtab = _mm_set1_epi8('\t');
+	const __m128i vdd = _mm_set1_epi8((char)0xdd);
+	const __m128i vat = _mm_set1_epi8('@');
+	while (posn + 16 <= size) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + posn));
+		__m128i dd = _mm_cmpeq_epi8(v, vdd);
+		unsigned ddmask = _mm_movemask_epi8(dd);
+		if (ddmask) {
+			v = _mm_or_si128(_mm_andnot_si128(dd, v), _mm_and_si128(dd, vtab));
+			_mm_storeu_si128((__m128i *)(data + posn), v);
+		}
+		unsigned nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vnl));
+		unsigned tab = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vtab));
+		unsigned at = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vat));
+		while (nl) {
+			unsigned bit = __builtin_ctz(nl);
+			unsigned upto = (2u << bit) - 1;
+			if (tab & upto)
+				st.cur |= LINE_TAB;
+			if (at & upto)
+				st.cur |= LINE_AT;
+			tab &= ~upto;
+			at &= ~upto;
+			nl &= nl - 1;
+			scan_line_end(&st, posn + bit);
+		}
+		if (tab)
+			st.cur |= LINE_TAB;
+		if (at)
+			st.cur |= LINE_AT;
+		posn += 16;
+	}
+#endif
+	while (posn < size) {
+		int ch = data[posn];
+		if (ch == '\n')
+			scan_line_end(&st, posn);
+		else if (ch == '\t')
+			st.cur |= LINE_TAB;
+		else if (ch == 0xdd) {
+			data[posn] = '\t';
+			st.cur |= LINE_TAB;
+		}
+		else if (ch == '@')
+			st.cur |= LINE_AT;
+		++posn;
+	}
+	st.lines[st.nlines] = size;
+	sf->lines = st.lines;
+	sf->flags = st.flags;
+	sf->nlines = st.nlines;
+	/* one record per line of what was found on it, filled in on first use */
+	if (!(sf->ir = calloc(st.nlines + 1, sizeof(struct lineir))))
+		srcfile_nomem((st.nlines + 1) * sizeof(struct lineir));
+}
+
+#include "charclass.h"
+
+/*
+ * Find the opcode field of a line, returning its length, or zero if
+ * the line has neither label nor opcode.
+ */
+
+static size_t guard_opcode(const char *ptr, const char **opname, bool *labelled)
+{
+	int ch = *ptr;
+	*labelled = !asm_isdelim(ch);
+	while (!asm_isdelim(ch))
+		ch = *++ptr;
+	while (asm_isspace(ch))
+		ch = *++ptr;
+	*opname = ptr;
+	while (!asm_isdelim(ch))
+		ch = *++ptr;
+	size_t len = ptr - *opname;
+	if (!len && *labelled)
+		len = 1;
+	return len;
+}
+
+static bool guard_match(const char *opname, size_t len, const char *word)
+{
+	if (len != strlen(word))
+		return false;
+	while (len--)
+		if (asm_toupper(*opname++) != *word++)
+			return false;
+	return true;
+}
+
+/*
+ * Check whether the file consists entirely of an IFNDEF and its
+ * matching FI, ignoring blank and comment lines outside them, and if
+ * so record where the symbol name in the IFNDEF starts.
+ */
+
+static void srcfile_guard(struct srcfile *sf)
+{
+	const char *guard = NULL;
+	unsigned depth = 0;
+	bool closed = false;
+	sf->guard = NULL;
+	for (unsigned lno = 0; lno < sf->nlines; ++lno) {
+		const char *opname;
+		bool labelled;
+		size_t len = guard_opcode(sf->data + sf->lines[lno], &opname, &labelled);
+		if (!len)
+			continue;
+		if (closed)
+			return; /* something after the closing FI */
+		if (!guard) {
+			if (labelled || !guard_match(opname, len, "IFNDEF"))
+				return;
+			const char *name = opname + len;
+			while (asm_isspace(*name))
+				++name;
+			int ch = *name;
+			if (!asm_isalpha(ch))
+				return;
+			guard = name;
+			depth = 1;
+		}
+		else if (guard_match(opname, len, "IF") || guard_match(opname, len, "IFDEF") || guard_match(opname, len, "IFNDEF"))
+			++depth;
+		else if (guard_match(opname, len, "ELSE")) {
+			if (depth == 1)
+				return;
+		}
+		else if (guard_match(opname, len, "FI") || guard_match(opname, len, "FIN")) {
+			if (--depth == 0) {
+				if (labelled)
+					return;
+				closed = true;
+			}
+		}
+	}
+	if (closed)
+		sf->guard = guard;
+}
+
+/*
+ * Blank and comment-only lines are recorded as having no operation
+ * up front so the assembler passes over them without scanning.
+ */
+
+static void srcfile_blanks(struct srcfile *sf)
+{
+	for (unsigned lno = 0; lno < sf->nlines; ++lno) {
+		const char *line = sf->data + sf->lines[lno];
+		const char *ptr = line;
+		while (asm_isspace(*ptr))
+			++ptr;
+		if (asm_isendchar(*ptr) && ptr - line <= 0xffff) {
+			struct lineir *ir = sf->ir + lno;
+			ir->kind = OP_NONE;
+			ir->opstart = ptr - line;
+		}
+	}
+}
+
+/*
+ * Load a file and prepare it for assembly.  This touches nothing
+ * shared so may be called from the prefetch thread.
+ */
+
+static struct srcfile *srcfile_make(const char *name, bool is_stdin)
+{
+	struct srcfile *sf = malloc(sizeof(struct srcfile));
+	if (!sf)
+		srcfile_nomem(sizeof(struct srcfile));
+	bool ok;
+	if (is_stdin)
+		ok = srcfile_read(sf, stdin);
+	else
+		ok = srcfile_load(sf, name);
+	if (!ok) {
+		int err = errno;
+		free(sf);
+		errno = err;
+		return NULL;
+	}
+	srcfile_sweep(sf);
+	if (sf->size && sf->data[sf->size-1] != '\n')
+		sf->data[sf->size++] = '\n';
+	srcfile_index(sf);
+	srcfile_guard(sf);
+	srcfile_blanks(sf);
+	return sf;
+}
+
+/*
+ * The store keeps every source file loaded during the run so each is
+ * read only once however many times it is assembled, i.e. on both
+ * passes and by each INCLUDE, CHN or macro that reaches it.  This is
+ * also what allows the source to come from a pipe: the name "-"
+ * refers to standard input.
+ *
+ * Files are keyed on their canonical path, so different spellings of
+ * the same file share one entry, but each name seen is also entered
+ * so that later references need not resolve the path again.
+ */
+
+#define STORE_SIZE 256
+
+struct srcname {
+	struct srcname *next;
+	struct srcfile *sf;
+	unsigned seq;
+	char name[1];
+};
+
+static struct srcname *store[STORE_SIZE];
+
+static unsigned srcfile_hash(const char *name)
+{
+	unsigned hash = 2166136261u;
+	int ch;
+	while ((ch = *name++))
+		hash = (hash ^ ch) * 16777619u;
+	return hash;
+}
+
+static struct srcname *srcfile_find(const char *name)
+{
+	struct srcname *sn;
+	for (sn = store[srcfile_hash(name) % STORE_SIZE]; sn; sn = sn->next)
+		if (!strcmp(sn->name, name))
+			return sn;
+	return NULL;
+}
+
+static struct srcname *srcfile_enter(const char *name, struct srcfile *sf)
+{
+	size_t name_len = strlen(name);
+	struct srcname *sn = malloc(sizeof(struct srcname) + name_len);
+	if (!sn)
+		srcfile_nomem(sizeof(struct srcname) + name_len);
+	memcpy(sn->name, name, name_len + 1);
+	sn->sf = sf;
+	sn->seq = 0;
+	struct srcname **head = store + srcfile_hash(name) % STORE_SIZE;
+	sn->next = *head;
+	*head = sn;
+	return sn;
+}
+
+#ifndef __WIN32__
+
+/*
+ * Prefetching.
+ *
+ * With the -j option a background thread loads and prepares the source
+ * files named on the command line, in order, and as it prepares each
+ * one it scans it for INCLUDE and CHN directives and prepares those
+ * files too, depth first, so files become ready in the order the
+ * assembler needs them.  Files named by CODE are only read ahead into
+ * the page cache.  Finished files are handed to the assembler thread
+ * through a single-producer single-consumer ring and entered in the
+ * store by that thread, which is the only one to touch the store.
+ * Either thread blocks on the ring's condition variable when it has
+ * to wait for the other.
+ *
+ * The prefetch thread may guess wrongly, for example a name inside
+ * skipped conditional code or built from MACRO arguments, and that
+ * only wastes some work.  Each delivery is numbered and the assembler
+ * thread stops waiting for a name once a file delivered after the
+ * last one it opened is also waiting, as the prefetch thread has then
+ * gone past the name, and loads the file itself.  So too a file the
+ * prefetch thread failed to load, so the error is reported in the
+ * usual way.
+ */
+
+#define RING_SIZE      64
+#define PREFETCH_MAX   256
+#define PREFETCH_DEPTH 16
+
+struct prefetched {
+	char *name;
+	char *path;
+	struct srcfile *sf;
+};
+
+struct spare {
+	struct spare *next;
+	struct srcfile *sf;
+};
+
+static struct prefetched ring[RING_SIZE];
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static unsigned ring_head, ring_tail;
+static bool prefetch_done;
+static bool prefetching;
+
+/* The following are used only by the assembler thread. */
+static unsigned prefetch_used;
+static struct spare *prefetch_spares;
+
+/* The following are used only by the prefetch thread. */
+static char **prefetch_argv;
+static int prefetch_argc;
+static char *prefetch_seen[PREFETCH_MAX];
+static unsigned prefetch_nseen;
+
+static void prefetch_put(char *name, char *path, struct srcfile *sf)
+{
+	pthread_mutex_lock(&ring_lock);
+	while (ring_head - ring_tail >= RING_SIZE)
+		pthread_cond_wait(&ring_cond, &ring_lock);
+	struct prefetched *pf = ring + ring_head % RING_SIZE;
+	pf->name = name;
+	pf->path = path;
+	pf->sf = sf;
+	++ring_head;
+	pthread_cond_signal(&ring_cond);
+	pthread_mutex_unlock(&ring_lock);
+}
+
+static void srcfile_free(struct srcfile *sf)
+{
+	if (sf->mapped)
+		munmap(sf->data, sf->mapped);
+	else
+		free(sf->data);
+	free(sf->lines);
+	free(sf->flags);
+	free(sf->ir);
+	free(sf);
+}
+
+static bool prefetch_new(const char *name)
+{
+	if (prefetch_nseen >= PREFETCH_MAX)
+		return false;
+	for (unsigned i = 0; i < prefetch_nseen; ++i)
+		if (!strcmp(prefetch_seen[i], name))
+			return false;
+	char *copy = strdup(name);
+	if (!copy)
+		return false;
+	prefetch_seen[prefetch_nseen++] = copy;
+	return true;
+}
+
+static void prefetch_code(const char *name)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+static void prefetch_file(const char *name, unsigned depth);
+
+static void prefetch_scan(const struct srcfile *sf, unsigned depth)
+{
+	for (unsigned lno = 0; lno < sf->nlines; ++lno) {
+		const char *opname;
+		bool labelled;
+		size_t len = guard_opcode(sf->data + sf->lines[lno], &opname, &labelled);
+		bool code = guard_match(opname, len, "CODE");
+		if (code || guard_match(opname, len, "INCLUDE") || guard_match(opname, len, "CHN")) {
+			const char *start = opname + len;
+			while (asm_isspace(*start))
+				++start;
+			const char *end = start;
+			while (*end != '\n' && !asm_isspace(*end))
+				++end;
+			size_t size = end - start;
+			char *fn;
+			if (size && !memchr(start, '@', size) && (fn = strndup(start, size))) {
+				if (code)
+					prefetch_code(fn);
+				else
+					prefetch_file(fn, depth + 1);
+				free(fn);
+			}
+		}
+	}
+}
+
+static void prefetch_file(const char *name, unsigned depth)
+{
+	if (depth > PREFETCH_DEPTH || !strcmp(name, "-") || !prefetch_new(name))
+		return;
+	char *path = realpath(name, NULL);
+	if (path) {
+		if (strcmp(path, name) && !prefetch_new(path)) {
+			/*
+			 * Another spelling of a file already delivered, so
+			 * deliver just the name: loading the file again would
+			 * hand over a duplicate for the assembler thread to
+			 * free while this thread may still be scanning it.
+			 */
+			char *copy = strdup(name);
+			if (copy)
+				prefetch_put(copy, path, NULL);
+			else
+				free(path);
+			return;
+		}
+		struct srcfile *sf = srcfile_make(name, false);
+		char *copy = strdup(name);
+		if (sf && copy) {
+			prefetch_put(copy, path, sf);
+			prefetch_scan(sf, depth);
+		}
+		else {
+			free(copy);
+			free(path);
+			if (sf)
+				srcfile_free(sf);
+		}
+	}
+}
+
+static void *prefetch_main(void *arg)
+{
+	for (int argno = 0; argno < prefetch_argc; ++argno)
+		prefetch_file(prefetch_argv[argno], 0);
+	while (prefetch_nseen)
+		free(prefetch_seen[--prefetch_nseen]);
+	pthread_mutex_lock(&ring_lock);
+	prefetch_done = true;
+	pthread_cond_signal(&ring_cond);
+	pthread_mutex_unlock(&ring_lock);
+	return NULL;
+}
+
+/*
+ * A file this thread loaded for itself may be delivered later too,
+ * and the prefetch thread may still be scanning that copy, so it is
+ * kept until the prefetch thread has finished.
+ */
+
+static void prefetch_spare(struct srcfile *sf)
+{
+	struct spare *sp = malloc(sizeof(struct spare));
+	if (!sp)
+		srcfile_nomem(sizeof(struct spare));
+	sp->sf = sf;
+	sp->next = prefetch_spares;
+	prefetch_spares = sp;
+}
+
+static void prefetch_drain(void)
+{
+	unsigned tail = ring_tail;
+	pthread_mutex_lock(&ring_lock);
+	unsigned head = ring_head;
+	pthread_mutex_unlock(&ring_lock);
+	while (tail != head) {
+		struct prefetched *pf = ring + tail % RING_SIZE;
+		struct srcname *sn = srcfile_find(pf->path);
+		++tail;
+		if (sn) {
+			/* already loaded by this thread or delivered by path only */
+			if (pf->sf)
+				prefetch_spare(pf->sf);
+			pf->sf = sn->sf;
+		}
+		else if (pf->sf)
+			srcfile_enter(pf->path, pf->sf)->seq = tail;
+		if (pf->sf && strcmp(pf->path, pf->name) && !srcfile_find(pf->name))
+			srcfile_enter(pf->name, pf->sf)->seq = tail;
+		free(pf->name);
+		free(pf->path);
+	}
+	pthread_mutex_lock(&ring_lock);
+	ring_tail = tail;
+	pthread_cond_signal(&ring_cond);
+	pthread_mutex_unlock(&ring_lock);
+}
+
+/*
+ * Wait for the prefetch thread to deliver a file, or to finish,
+ * entering in the store whatever it delivers meanwhile.
+ */
+
+static struct srcname *prefetch_wait(const char *name)
+{
+	struct srcname *sn;
+	for (;;) {
+		prefetch_drain();
+		if ((sn = srcfile_find(name)))
+			return sn;
+		if (ring_tail > prefetch_used)
+			return NULL;
+		pthread_mutex_lock(&ring_lock);
+		while (ring_head == ring_tail && !prefetch_done)
+			pthread_cond_wait(&ring_cond, &ring_lock);
+		bool done = prefetch_done && ring_head == ring_tail;
+		pthread_mutex_unlock(&ring_lock);
+		if (done) {
+			prefetching = false;
+			while (prefetch_spares) {
+				struct spare *sp = prefetch_spares;
+				prefetch_spares = sp->next;
+				srcfile_free(sp->sf);
+				free(sp);
+			}
+			return NULL;
+		}
+	}
+}
+
+#endif
+
+void srcfile_prefetch(int argc, char **argv)
+{
+#ifndef __WIN32__
+	prefetch_argc = argc;
+	prefetch_argv = argv;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, prefetch_main, NULL) == 0) {
+		pthread_detach(thread);
+		prefetching = true;
+	}
+#endif
+}
+
+struct srcfile *srcfile_open(const char *name)
+{
+	struct srcname *sn = srcfile_find(name);
+	bool is_stdin = name[0] == '-' && name[1] == 0;
+#ifndef __WIN32__
+	if (!sn && prefetching && !is_stdin)
+		sn = prefetch_wait(name);
+	if (sn && sn->seq > prefetch_used)
+		prefetch_used = sn->seq;
+#endif
+	if (sn)
+		return sn->sf;
+	char *path = NULL;
+#ifndef __WIN32__
+	if (!is_stdin) {
+		if (!(path = realpath(name, NULL)))
+			return NULL;
+		if ((sn = srcfile_find(path))) {
+			free(path);
+			srcfile_enter(name, sn->sf);
+			return sn->sf;
+		}
+	}
+#endif
+	struct srcfile *sf = srcfile_make(name, is_stdin);
+	if (!sf) {
+		int err = errno;
+		free(path);
+		errno = err;
+		return NULL;
+	}
+	if (path) {
+		srcfile_enter(path, sf);
+		if (strcmp(path, name))
+			srcfile_enter(name, sf);
+		free(path);
+	}
+	else
+		srcfile_enter(name, sf);
+	return sf;
+}
+
+/*
+ * Binary files included with CODE are never copied through objcode.
+ * Pass 1 needs only the size; on pass 2 the slice wanted is mapped,
+ * so the listing can show the bytes, and copied to the object file
+ * by the kernel where it can do that.
+ */
+
+long codefile_open(const char *name)
+{
+#ifdef __WIN32__
+	FILE *fp = fopen(name, "rb");
+	if (!fp)
+		return -1;
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	code_slice.fp = fp;
+	return size;
+#else
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat stb;
+	if (fstat(fd, &stb)) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	code_slice.fd = fd;
+	return stb.st_size;
+#endif
+}
+
+bool codefile_slice(size_t offset, size_t size)
+{
+	code_slice.offset = offset;
+	code_slice.size = 0;    /* left empty on failure so nothing is listed or written */
+	if (passno && size) {
+#ifdef __WIN32__
+		if (!(code_slice.map = malloc(size)))
+			return false;
+		fseek(code_slice.fp, offset, SEEK_SET);
+		if (fread(code_slice.map, size, 1, code_slice.fp) != 1)
+			return false;
+		code_slice.bytes = code_slice.map;
+#else
+		size_t skip = offset % sysconf(_SC_PAGESIZE);
+		void *map = mmap(NULL, size + skip, PROT_READ, MAP_PRIVATE, code_slice.fd, offset - skip);
+		if (map == MAP_FAILED)
+			return false;
+		code_slice.map = map;
+		code_slice.maplen = size + skip;
+		code_slice.bytes = (uint8_t *)map + skip;
+#endif
+	}
+	code_slice.size = size;
+	return true;
+}
+
+void codefile_write(FILE *fp)
+{
+	size_t togo = code_slice.size;
+#ifndef __WIN32__
+	off_t offset = code_slice.offset;
+	int out = fileno(fp);
+	fflush(fp);
+	while (togo > 0) {
+		ssize_t bytes = copy_file_range(code_slice.fd, &offset, out, NULL, togo, 0);
+		if (bytes <= 0)
+			break;
+		togo -= bytes;
+	}
+	while (togo > 0) {
+		ssize_t bytes = sendfile(out, code_slice.fd, &offset, togo);
+		if (bytes <= 0)
+			break;
+		togo -= bytes;
+	}
+#endif
+	if (togo > 0)
+		fwrite(code_slice.bytes + code_slice.size - togo, togo, 1, fp);
+}
+
+void codefile_close(void)
+{
+#ifdef __WIN32__
+	free(code_slice.map);
+	fclose(code_slice.fp);
+	code_slice.fp = NULL;
+#else
+	if (code_slice.map)
+		munmap(code_slice.map, code_slice.maplen);
+	close(code_slice.fd);
+	code_slice.fd = -1;
+#endif
+	code_slice.map = NULL;
+	code_slice.bytes = NULL;
+	code_slice.size = 0;
+}
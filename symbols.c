@@ -2,154 +2,591 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
-#include <search.h>
 
-void *symbols = NULL;
+#include "charclass.h"
+
+/*
+ * Symbols are kept in an open-addressing hash table with linear
+ * probing.  Each slot holds the full hash as well as the symbol so
+ * most non-matching slots are passed over without looking at the
+ * symbol itself.  Names are stored in upper case and the name being
+ * looked up is case-folded as it is hashed so the source text can be
+ * compared directly against the stored name without making a copy.
+ *
+ * In ADE mode only the first six characters of a name are significant
+ * so only those are hashed and compared.
+ */
+
+struct symslot {
+	uint32_t hash;
+	struct symbol *sym;
+};
+
+unsigned symbol_sig = (unsigned)-1;
+unsigned sym_pass;
+
+static struct symslot *sym_table;
+static size_t sym_slots, sym_hashed;
+static struct symbol **sym_sorted;
 
 static unsigned sym_max = 0;
 static unsigned sym_count = 0;
 static unsigned sym_col, sym_cols;
 
-static int symbol_cmp_lancs(const void *a, const void *b)
+static uint32_t symbol_hash(const char *src, size_t len, int scope)
 {
-	const struct symbol *sa = a;
-	const struct symbol *sb = b;
-	int res = strcmp(sa->name, sb->name);
-	if (!res)
-		res = sa->scope - sb->scope;
-	return res;
+	if (len > symbol_sig)
+		len = symbol_sig;
+	uint32_t hash = 2166136261u ^ scope;
+	while (len--)
+		hash = (hash ^ (uint8_t)asm_toupper(*src++)) * 16777619u;
+	return hash | 1; /* zero marks an empty slot */
 }
 
-int symbol_cmp_ade(const void *a, const void *b)
+static bool symbol_match(const struct symbol *sym, const char *src, size_t len, int scope)
 {
-	const struct symbol *sa = a;
-	const struct symbol *sb = b;
-	int res = strncmp(sa->name, sb->name, 6);
-	if (!res)
-		res = sa->scope - sb->scope;
-	return res;
+	if (sym->scope != scope)
+		return false;
+	if (len > symbol_sig)
+		len = symbol_sig;
+	const char *name = sym->name;
+	for (size_t i = 0; i < len; ++i)
+		if (name[i] != asm_toupper(src[i]))
+			return false;
+	return len == symbol_sig || !name[len];
+}
+
+static void *symbol_realloc(void *ptr, size_t size)
+{
+	if (!(ptr = realloc(ptr, size))) {
+		fprintf(stderr, "laxasm: out of memory growing the symbol table\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static void symbol_grow(void)
+{
+	size_t old_slots = sym_slots;
+	struct symslot *old_table = sym_table;
+	sym_slots = old_slots ? old_slots << 1 : 1024;
+	if (!(sym_table = calloc(sym_slots, sizeof(struct symslot)))) {
+		fprintf(stderr, "laxasm: out of memory growing the symbol table\n");
+		exit(1);
+	}
+	size_t mask = sym_slots - 1;
+	for (size_t i = 0; i < old_slots; ++i) {
+		struct symslot *old = old_table + i;
+		if (old->hash) {
+			size_t slot = old->hash & mask;
+			while (sym_table[slot].hash)
+				slot = (slot + 1) & mask;
+			sym_table[slot] = *old;
+		}
+	}
+	free(old_table);
+}
+
+/*
+ * Find the slot for a name, returning either the slot holding the
+ * symbol or the empty slot where it would be entered.
+ */
+
+static struct symslot *symbol_slot(const char *src, size_t len, int scope, uint32_t hash)
+{
+	if (!sym_slots)
+		symbol_grow();
+	size_t mask = sym_slots - 1;
+	size_t slot = hash & mask;
+	struct symslot *ss;
+	while ((ss = sym_table + slot)->hash) {
+		if (ss->hash == hash && symbol_match(ss->sym, src, len, scope))
+			break;
+		slot = (slot + 1) & mask;
+	}
+	return ss;
+}
+
+/*
+ * Local symbols, those whose names start with a colon, are visible only
+ * within the BLOCK that defines them.  BLOCKs are numbered in order and
+ * all the local symbols of one BLOCK are defined before the next starts
+ * so they are kept in a single array, in order of definition, with an
+ * index of where each BLOCK's symbols start.  A BLOCK usually has only a
+ * few local symbols and these are found by comparing hashes in turn.
+ * Should a BLOCK define more than LOCAL_FLAT, the rest go in the main
+ * hash table.  After pass 1 the arrays are trimmed to size and only read.
+ */
+
+#define LOCAL_FLAT 16
+
+static struct symslot *loc_syms;
+static uint32_t *loc_start;
+static size_t loc_count, loc_alloc;
+static unsigned loc_blocks, loc_balloc;
+static bool loc_spilled;
+
+static struct symbol *symbol_local(const char *src, size_t len, int scope, uint32_t hash)
+{
+	unsigned blk = scope - SCOPE_LOCAL;
+	if (blk < loc_blocks) {
+		const struct symslot *ss = loc_syms + loc_start[blk];
+		const struct symslot *end = loc_syms + (blk + 1 < loc_blocks ? loc_start[blk + 1] : loc_count);
+		for (; ss < end; ++ss)
+			if (ss->hash == hash && symbol_match(ss->sym, src, len, scope))
+				return ss->sym;
+	}
+	return NULL;
+}
+
+static bool symbol_local_add(int scope, uint32_t hash, struct symbol *sym)
+{
+	unsigned blk = scope - SCOPE_LOCAL;
+	if (blk + 1 < loc_blocks)
+		return false; /* not the latest BLOCK */
+	while (loc_blocks <= blk) {
+		if (loc_blocks == loc_balloc) {
+			loc_balloc = loc_balloc ? loc_balloc << 1 : 256;
+			loc_start = symbol_realloc(loc_start, loc_balloc * sizeof(uint32_t));
+		}
+		loc_start[loc_blocks++] = loc_count;
+	}
+	if (loc_count - loc_start[blk] >= LOCAL_FLAT)
+		return false;
+	if (loc_count == loc_alloc) {
+		loc_alloc = loc_alloc ? loc_alloc << 1 : 256;
+		loc_syms = symbol_realloc(loc_syms, loc_alloc * sizeof(struct symslot));
+	}
+	struct symslot *ss = loc_syms + loc_count++;
+	ss->hash = hash;
+	ss->sym = sym;
+	return true;
+}
+
+void symbol_freeze(void)
+{
+	if (loc_count) {
+		loc_syms = symbol_realloc(loc_syms, loc_count * sizeof(struct symslot));
+		loc_alloc = loc_count;
+	}
+	if (loc_blocks) {
+		loc_start = symbol_realloc(loc_start, loc_blocks * sizeof(uint32_t));
+		loc_balloc = loc_blocks;
+	}
+}
+
+static struct symbol *symbol_find(const char *src, size_t len, int scope)
+{
+	uint32_t hash = symbol_hash(src, len, scope);
+	if (scope >= SCOPE_LOCAL) {
+		struct symbol *sym = symbol_local(src, len, scope, hash);
+		if (sym || !loc_spilled)
+			return sym;
+	}
+	return symbol_slot(src, len, scope, hash)->sym;
 }
 
-int (*symbol_cmp)(const void *, const void *) = symbol_cmp_lancs;
 struct symbol *(*symbol_enter)(struct inctx *inp, size_t label_size, int scope, bool update);
 
+/*
+ * The symbols found on a line are kept in its lineir by position.  The
+ * scope is part of the key as the same line may be assembled within
+ * different BLOCKs.
+ */
+
+static struct symref *symbol_cached(struct inctx *inp, size_t posn, unsigned scope)
+{
+	struct lineir *ir = inp->ir;
+	if (ir) {
+		struct symref *ref = ir->refs;
+		struct symref *end = ref + ir->nrefs;
+		while (ref < end) {
+			if (ref->posn == posn && ref->scope == scope)
+				return ref;
+			++ref;
+		}
+	}
+	return NULL;
+}
+
+static void symbol_cache(struct inctx *inp, size_t posn, size_t len, unsigned scope, struct symbol *sym)
+{
+	struct lineir *ir = inp->ir;
+	if (ir && ir->nrefs < MAX_SYMREFS && posn <= 0xffff && len <= 0xffff) {
+		if (!ir->refs)
+			ir->refs = arena_alloc(&run_arena, MAX_SYMREFS * sizeof(struct symref));
+		struct symref *ref = ir->refs + ir->nrefs++;
+		ref->sym = sym;
+		ref->scope = scope;
+		ref->posn = posn;
+		ref->len = len;
+	}
+}
+
 int symbol_parse(struct inctx *inp)
 {
 	int ch;
 	do
 		ch = *++inp->lineptr;
-	while ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch == '.' || ch == '$' || ch == '_');
+	while (asm_issymch(ch));
 	return ch;
 }
 
-static void symbol_uppercase(const char *src, size_t label_size, char *dest)
+void symbol_uppercase(const char *src, size_t label_size, char *dest)
 {
-	while (label_size--) {
-		int ch = *src++;
-		if (ch >= 'a' && ch <= 'z')
-			ch &= 0xdf;
-		*dest++ = ch;
-	}
+	while (label_size--)
+		*dest++ = asm_toupper(*src++);
 	*dest = 0;
 }
 
+/* An upper-cased copy of a name for an error message, valid until the next call. */
+
+const char *symbol_errname(const char *src, size_t len)
+{
+	static struct dstring name;
+	name.used = 0;
+	dstr_grow(&name, len + 1);
+	symbol_uppercase(src, len, name.str);
+	return name.str;
+}
+
 struct symbol *symbol_enter_pass1(struct inctx *inp, size_t label_size, int scope, bool update)
 {
-	struct symbol *sym = malloc(sizeof(struct symbol) + label_size + 1);
+	const char *name = inp->line.str;
+	uint32_t hash = symbol_hash(name, label_size, scope);
+	struct symbol *sym = NULL;
+	if (scope >= SCOPE_LOCAL)
+		sym = symbol_local(name, label_size, scope, hash);
+	if (!sym && (scope < SCOPE_LOCAL || loc_spilled))
+		sym = symbol_slot(name, label_size, scope, hash)->sym;
 	if (sym) {
-		sym->scope = scope;
-		sym->name = sym->name_str;
-		sym->used = 0;
-		symbol_uppercase(inp->line.str, label_size, sym->name_str);
-		struct symbol **res = tsearch(sym, &symbols, symbol_cmp);
-		if (!res)
-			asm_error(inp, "out of memory allocating a symbol");
-		else if (*res != sym) {
-			if (update) {
-				free(sym);
-				return *res;
-			}
-			asm_error(inp, "symbol %s already defined", sym->name);
-			free(sym);
-		}
-		else {
-			++sym_count;
-			if (label_size > sym_max)
-				sym_max = label_size;
+		if (update) {
+			sym->defpass = sym_pass;
 			return sym;
 		}
+		asm_error(inp, "symbol %s already defined", symbol_errname(name, label_size));
+		return NULL;
 	}
-	else
-		asm_error(inp, "out of memory allocating a symbol");
-	return NULL;
+	sym = arena_alloc(&run_arena, sizeof(struct symbol) + label_size + 1);
+	sym->scope = scope;
+	sym->name = sym->name_str;
+	sym->used = 0;
+	sym->assigned = 0;
+	sym->def = NULL;
+	sym->users = NULL;
+	sym->defpass = sym_pass;
+	symbol_uppercase(name, label_size, sym->name_str);
+	if (scope < SCOPE_LOCAL || !symbol_local_add(scope, hash, sym)) {
+		struct symslot *ss = symbol_slot(name, label_size, scope, hash);
+		ss->hash = hash;
+		ss->sym = sym;
+		if (scope >= SCOPE_LOCAL)
+			loc_spilled = true;
+		if (++sym_hashed > sym_slots / 2)
+			symbol_grow();
+	}
+	symbol_cache(inp, 0, label_size, scope, sym);
+	++sym_count;
+	if (label_size > sym_max)
+		sym_max = label_size;
+	return sym;
 }
 
 struct symbol *symbol_enter_pass2(struct inctx *inp, size_t label_size, int scope, bool update)
 {
-	char label[label_size+1];
-	symbol_uppercase(inp->line.str, label_size, label);
-	struct symbol sym;
-	sym.scope = scope;
-	sym.name = label;
-	void *node = tfind(&sym, &symbols, symbol_cmp);
-	if (node)
-		return *(struct symbol **)node;
+	struct symref *ref = symbol_cached(inp, 0, scope);
+	if (ref) {
+		ref->sym->defpass = sym_pass;
+		return ref->sym;
+	}
+	struct symbol *sym = symbol_find(inp->line.str, label_size, scope);
+	if (sym) {
+		sym->defpass = sym_pass;
+		symbol_cache(inp, 0, label_size, scope, sym);
+	}
 	else {
-		asm_error(inp, "symbol %s has disappeared between pass 1 and pass 2", label);
-		return NULL;
+		asm_error(inp, "symbol %s has disappeared between pass 1 and pass 2", symbol_errname(inp->line.str, label_size));
 	}
+	return sym;
 }
 
 struct symbol *symbol_lookup(struct inctx *inp, bool no_undef)
 {
 	const char *lab_start = inp->lineptr;
+	int scope = *lab_start == ':' ? scope_no : SCOPE_GLOBAL;
+	size_t posn = lab_start - inp->line.str;
+	struct symref *ref = symbol_cached(inp, posn, scope);
+	if (ref) {
+		inp->lineptr += ref->len;
+		ref->sym->used = 1;
+		return ref->sym;
+	}
 	symbol_parse(inp);
 	size_t lab_size = inp->lineptr - lab_start;
-	char label[lab_size+1];
-	symbol_uppercase(lab_start, lab_size, label);
-	struct symbol sym;
-	sym.scope = *lab_start == ':' ? scope_no : SCOPE_GLOBAL;
-	sym.name = label;
-	void *node = tfind(&sym, &symbols, symbol_cmp);
-	if (node) {
-		struct symbol *sym = *(struct symbol **)node;
+	struct symbol *sym = symbol_find(lab_start, lab_size, scope);
+	if (sym) {
+		symbol_cache(inp, posn, lab_size, scope, sym);
 		sym->used = 1;
 		return sym;
 	}
 	if (no_undef)
-		asm_error(inp, "symbol %s not found", label);
+		asm_error(inp, "symbol %s not found", symbol_errname(lab_start, lab_size));
 	return NULL;
 }
 
-static void print_one(const void *nodep, VISIT which, int depth)
+/*
+ * For IFDEF, IFNDEF and include guards a symbol is defined only once
+ * its definition has been passed on the current pass: the symbols from
+ * the previous pass are all still in the table.
+ */
+
+bool symbol_defined(struct inctx *inp)
+{
+	struct symbol *sym = symbol_lookup(inp, false);
+	return sym && sym->defpass == sym_pass;
+}
+
+struct symbol *symbol_macfind(const char *opname, size_t len)
 {
-	if (which == leaf || which == postorder) {
-		const struct symbol *sym = *(const struct symbol **)nodep;
-		if (sym->scope == SCOPE_MACRO) {
-			const char *fmt = "%-*s MACRO   ";
-			if (++sym_col == sym_cols) {
-				fmt = "%-*s  MACRO\n";
-				sym_col = 0;
-			}
-			fprintf(list_fp, fmt, sym_max, sym->name);
+	return symbol_find(opname, len, SCOPE_MACRO);
+}
+
+/*
+ * An EQU that refers forward to a symbol not yet defined is kept, with
+ * a copy of its line, and evaluated when the symbol is first wanted,
+ * which may be before or after the EQU itself.  Symbols it refers to
+ * that are themselves deferred are evaluated first, and so on, with a
+ * symbol met again while it is being evaluated being a circular
+ * definition.  Each symbol used while evaluating a deferred EQU records
+ * that EQU so that, should its value change, as with a symbol set by
+ * '=', the EQU is evaluated again when next wanted.  This avoids the
+ * wrong values that evaluating such an EQU in order would give, on
+ * either pass, and lets one-pass assembly use them.
+ */
+
+enum defstate {
+	DEF_PENDING,
+	DEF_BUSY,
+	DEF_DONE
+};
+
+struct symdef {
+	struct symdef *next;
+	struct symbol *sym;
+	const char *name;
+	unsigned lineno;
+	unsigned scope;
+	unsigned exprpos;
+	uint16_t org;
+	uint8_t state;
+	size_t length;
+	char text[];
+};
+
+struct symuse {
+	struct symuse *next;
+	struct symbol *user;
+};
+
+static struct symdef *def_list;
+static struct symbol *sym_defining, *sym_resolving;
+static struct inctx *def_inp;
+
+static void symbol_invalidate(struct symbol *sym)
+{
+	struct symuse *use = sym->users;
+	sym->users = NULL;
+	for (; use; use = use->next) {
+		struct symdef *def = use->user->def;
+		if (def && def->state == DEF_DONE) {
+			def->state = DEF_PENDING;
+			symbol_invalidate(use->user);
+		}
+	}
+}
+
+void symbol_set(struct symbol *sym, uint16_t value)
+{
+	if (sym->users && sym->value != value)
+		symbol_invalidate(sym);
+	sym->value = value;
+}
+
+static void symbol_defctx(struct symdef *def, struct inctx *ctx)
+{
+	ctx->ir = NULL;
+	ctx->name = def->name;
+	ctx->lineno = def->lineno;
+	ctx->line.str = def->text;
+	ctx->line.used = def->length;
+	ctx->line.allocated = 0;
+	ctx->lineptr = def->text + def->exprpos;
+}
+
+static bool symbol_resolve(struct symbol *sym, bool no_undef)
+{
+	struct symdef *def = sym->def;
+	struct inctx dctx;
+	symbol_defctx(def, &dctx);
+	uint16_t save_org = org;
+	unsigned save_scope = scope_no;
+	struct symbol *save_resolving = sym_resolving;
+	bool save_forward = expr_forward;
+	org = def->org;
+	scope_no = def->scope;
+	sym_resolving = sym;
+	def->state = DEF_BUSY;
+	uint16_t value = expression(&dctx, no_undef);
+	bool ok = !expr_forward;
+	def->state = ok ? DEF_DONE : DEF_PENDING;
+	org = save_org;
+	scope_no = save_scope;
+	sym_resolving = save_resolving;
+	expr_forward = save_forward;
+	if (ok)
+		symbol_set(sym, value);
+	return ok;
+}
+
+/*
+ * Make sure a symbol about to be used has a value, returning false if
+ * it cannot have one yet.
+ */
+
+bool symbol_ready(struct symbol *sym, bool no_undef)
+{
+	if (sym_resolving && (!sym->users || sym->users->user != sym_resolving)) {
+		struct symuse *use = arena_alloc(&run_arena, sizeof(struct symuse));
+		use->user = sym_resolving;
+		use->next = sym->users;
+		sym->users = use;
+	}
+	struct symdef *def = sym->def;
+	if (def && def->state == DEF_BUSY) {
+		struct inctx dctx;
+		symbol_defctx(def, &dctx);
+		asm_error(&dctx, "circular definition of symbol %s", sym->name);
+		return false;
+	}
+	if (sym == sym_defining) {
+		asm_error(def_inp, "circular definition of symbol %s", sym->name);
+		return false;
+	}
+	if (!def || def->state == DEF_DONE)
+		return true;
+	return symbol_resolve(sym, no_undef);
+}
+
+/*
+ * Evaluate the expression for an EQU.  On the pass that defines symbols
+ * one that refers forward is deferred and zero returned for the listing.
+ */
+
+uint16_t symbol_equ(struct inctx *inp, struct symbol *sym)
+{
+	char *expr = inp->lineptr;
+	sym_defining = sym;
+	def_inp = inp;
+	uint16_t value = expression(inp, !pass_defines);
+	sym_defining = NULL;
+	if (pass_defines && expr_forward && !err_message) {
+		struct symdef *def = sym->def;
+		if (!def || def->length < inp->line.used) {
+			def = arena_alloc(&run_arena, sizeof(struct symdef) + inp->line.used);
+			def->sym = sym;
+			def->next = def_list;
+			def_list = def;
+			sym->def = def;
+		}
+		def->name = inp->name;
+		def->lineno = inp->lineno;
+		def->scope = scope_no;
+		def->exprpos = expr - inp->line.str;
+		def->org = org;
+		def->state = DEF_PENDING;
+		def->length = inp->line.used;
+		memcpy(def->text, inp->line.str, inp->line.used);
+		sym->value = 0;
+		return 0;
+	}
+	if (!pass_defines && sym->value != value && (!sym->def || sym->def->state == DEF_DONE))
+		asm_drift(inp, sym, value);
+	sym->def = NULL;
+	symbol_set(sym, value);
+	return value;
+}
+
+/*
+ * Evaluate any EQUs still deferred at the end of assembly, reporting
+ * those that cannot be.
+ */
+
+void symbol_resolve_all(void)
+{
+	for (struct symdef *def = def_list; def; def = def->next)
+		if (def->sym->def == def && def->state == DEF_PENDING)
+			symbol_resolve(def->sym, true);
+}
+
+/*
+ * The symbol table listings are in name order so the symbols are
+ * sorted once, when first needed at the end of assembly.
+ */
+
+static int symbol_cmp(const void *a, const void *b)
+{
+	const struct symbol *sa = *(const struct symbol **)a;
+	const struct symbol *sb = *(const struct symbol **)b;
+	int res = strncmp(sa->name, sb->name, symbol_sig);
+	if (!res)
+		res = sa->scope - sb->scope;
+	return res;
+}
+
+static struct symbol **symbol_sort(void)
+{
+	if (!sym_sorted && sym_count) {
+		if (!(sym_sorted = malloc(sym_count * sizeof(struct symbol *)))) {
+			fprintf(stderr, "laxasm: out of memory sorting symbols\n");
+			exit(1);
+		}
+		struct symbol **ptr = sym_sorted;
+		for (size_t i = 0; i < sym_slots; ++i)
+			if (sym_table[i].hash)
+				*ptr++ = sym_table[i].sym;
+		for (size_t i = 0; i < loc_count; ++i)
+			*ptr++ = loc_syms[i].sym;
+		qsort(sym_sorted, sym_count, sizeof(struct symbol *), symbol_cmp);
+	}
+	return sym_sorted;
+}
+
+static void print_one(const struct symbol *sym)
+{
+	if (sym->scope == SCOPE_MACRO) {
+		const char *fmt = "%-*s MACRO   ";
+		if (++sym_col == sym_cols) {
+			fmt = "%-*s  MACRO\n";
+			sym_col = 0;
+		}
+		fprintf(list_fp, fmt, sym_max, sym->name);
+	}
+	else {
+		const char *fmt;
+		if (++sym_col == sym_cols) {
+			if (sym->used)
+				fmt = "%-*s &%04X\n";
+			else
+				fmt = "%-*s &%04X-\n";
+			sym_col = 0;
 		}
 		else {
-			const char *fmt;
-			if (++sym_col == sym_cols) {
-				if (sym->used)
-					fmt = "%-*s &%04X\n";
-				else
-					fmt = "%-*s &%04X-\n";
-				sym_col = 0;
-			}
-			else {
-				if (sym->used)
-					fmt = "%-*s &%04X  ";
-				else
-					fmt = "%-*s &%04X- ";
-			}
-			fprintf(list_fp, fmt, sym_max, sym->name, sym->value);
+			if (sym->used)
+				fmt = "%-*s &%04X  ";
+			else
+				fmt = "%-*s &%04X- ";
 		}
+		fprintf(list_fp, fmt, sym_max, sym->name, sym->value);
 	}
 }
 
@@ -162,33 +599,25 @@ void symbol_print(void)
 		fprintf(list_fp, "\n%d symbols defined\n\n", sym_count);
 		sym_cols = page_width / (sym_max + 9);
 		sym_col = 0;
-		twalk(symbols, print_one);
+		struct symbol **sorted = symbol_sort();
+		for (unsigned i = 0; i < sym_count; ++i)
+			print_one(sorted[i]);
 		if (sym_col)
 			putc('\n', list_fp);
 	}
 }
 
-static bool first;
-
-static void print_swift(const void *nodep, VISIT which, int depth)
+void symbol_swift(void)
 {
-	if (which == leaf || which == postorder) {
-		const struct symbol *sym = *(const struct symbol **)nodep;
+	const char *fmt = "'%s':%uL";
+	fputs("[{", stdout);
+	struct symbol **sorted = symbol_sort();
+	for (unsigned i = 0; i < sym_count; ++i) {
+		const struct symbol *sym = sorted[i];
 		if (sym->scope == SCOPE_GLOBAL) {
-			const char *fmt = ",'%s':%uL";
-			if (first) {
-				fmt = "'%s':%uL";
-				first = false;
-			}
 			printf(fmt, sym->name, sym->value);
+			fmt = ",'%s':%uL";
 		}
 	}
-}
-
-void symbol_swift(void)
-{
-	fputs("[{", stdout);
-	first = true;
-	twalk(symbols, print_swift);
 	fputs("}]\n", stdout);
 }